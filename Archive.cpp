@@ -0,0 +1,549 @@
+#include "Archive.h"
+#include "PathHash.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+
+namespace ImageDetector
+{
+    // bytes buffered before they are written out in one go.
+    static const size_t FLUSH_BYTES = 4 * 1024 * 1024;
+
+    // existing segments start_segment steps over before giving up.
+    static const int MAX_SEGMENT_TRIES = 64;
+
+    static const uint32_t RECORD_MAGIC = 0x504f5243; // "CROP"
+    static const char INDEX_MAGIC[8] = {'I', 'D', 'C', 'R', 'O', 'P', 'S', '1'};
+
+    /**
+     * Starts every record in a segment, so a segment can be re-indexed on
+     * its own. Followed by path_size bytes of path and data_size bytes of
+     * encoded crop.
+     */
+    class RecordHeader
+    {
+    public:
+        uint32_t magic;
+        uint32_t path_size;
+        uint32_t data_size;
+        int32_t x;
+        int32_t y;
+        int32_t w;
+        int32_t h;
+    };
+
+    class IndexHeader
+    {
+    public:
+        char magic[8];
+        uint64_t count;
+    };
+
+    static std::string segment_path(const std::string &dir, const std::string &name, int seq, const char *ext)
+    {
+        return dir + "/" + name + "-" + std::to_string(seq) + ext;
+    } // segment_path
+
+    static bool ends_with(const std::string &s, const std::string &suffix)
+    {
+        return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+    } // ends_with
+
+    static std::vector<std::string> list_dir(const std::string &dir)
+    {
+        std::vector<std::string> names;
+
+        DIR *d = opendir(dir.c_str());
+        if (d == NULL)
+        {
+            return names;
+        }
+
+        struct dirent *e;
+        while ((e = readdir(d)) != NULL)
+        {
+            names.push_back(e->d_name);
+        }
+        closedir(d);
+
+        std::sort(names.begin(), names.end());
+        return names;
+    } // list_dir
+
+    static bool write_all(int fd, const char *data, size_t size)
+    {
+        while (size > 0)
+        {
+            ssize_t written = write(fd, data, size);
+            if (written <= 0)
+            {
+                return false;
+            }
+            data += written;
+            size -= written;
+        }
+        return true;
+    } // write_all
+
+    static bool by_key(const ArchiveEntry &a, const ArchiveEntry &b)
+    {
+        return a.key < b.key || (a.key == b.key && a.offset < b.offset);
+    } // by_key
+
+    static bool write_index(const std::string &path, std::vector<ArchiveEntry> entries)
+    {
+        std::sort(entries.begin(), entries.end(), by_key);
+
+        IndexHeader header;
+        memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+        header.count = entries.size();
+
+        // written aside and renamed so readers only ever see whole indexes.
+        std::string tmp = path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        bool ok = write_all(fd, (const char *)&header, sizeof(header)) &&
+                  write_all(fd, (const char *)entries.data(), entries.size() * sizeof(ArchiveEntry)) &&
+                  fdatasync(fd) == 0;
+        ::close(fd);
+
+        return ok && rename(tmp.c_str(), path.c_str()) == 0;
+    } // write_index
+
+    ArchiveWriter::ArchiveWriter()
+    {
+        segment_bytes = 0;
+        seq = 0;
+        fd = -1;
+        size = 0;
+        failed = false;
+    }
+
+    ArchiveWriter::~ArchiveWriter()
+    {
+        close();
+    }
+
+    bool ArchiveWriter::open(const std::string &dir, const std::string &name, size_t segment_bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        this->dir = dir;
+        this->name = name;
+        this->segment_bytes = segment_bytes;
+        failed = false;
+
+        // carry on after whatever an earlier run of this writer left.
+        seq = 0;
+        std::string prefix = name + "-";
+        std::vector<std::string> names = list_dir(dir);
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            if (names[i].compare(0, prefix.size(), prefix) == 0 && ends_with(names[i], ".seg"))
+            {
+                seq = MAX(seq, atoi(names[i].c_str() + prefix.size()) + 1);
+            }
+        }
+
+        return start_segment();
+    } // open
+
+    bool ArchiveWriter::start_segment()
+    {
+        // another writer under the same name may have taken this sequence
+        // number since; skip past it rather than share its segment.
+        for (int tries = 0; tries < MAX_SEGMENT_TRIES; tries++, seq++)
+        {
+            std::string path = segment_path(dir, name, seq, ".seg");
+            fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+            if (fd >= 0 || errno != EEXIST)
+            {
+                break;
+            }
+        }
+
+        size = 0;
+        entries.clear();
+        failed = failed || fd < 0;
+        return !failed;
+    } // start_segment
+
+    bool ArchiveWriter::flush()
+    {
+        if (!buffer.empty() && !write_all(fd, buffer.data(), buffer.size()))
+        {
+            failed = true;
+        }
+        buffer.clear();
+        return !failed;
+    } // flush
+
+    bool ArchiveWriter::finish_segment()
+    {
+        flush();
+        if (!failed && !write_index(segment_path(dir, name, seq, ".idx"), entries))
+        {
+            failed = true;
+        }
+
+        if (fdatasync(fd) != 0)
+        {
+            failed = true;
+        }
+        ::close(fd);
+        fd = -1;
+        return !failed;
+    } // finish_segment
+
+    bool ArchiveWriter::add(const std::string &path, const ImageDetails &details,
+                            const std::vector<uchar> &encoded)
+    {
+        RecordHeader header;
+        header.magic = RECORD_MAGIC;
+        header.path_size = (uint32_t)path.size();
+        header.data_size = (uint32_t)encoded.size();
+        header.x = details.x;
+        header.y = details.y;
+        header.w = details.w;
+        header.h = details.h;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (failed || fd < 0)
+        {
+            return false;
+        }
+
+        ArchiveEntry entry;
+        entry.key = path_hash(path.data(), path.size());
+        entry.offset = size;
+        entry.path_size = header.path_size;
+        entry.data_size = header.data_size;
+        entry.x = header.x;
+        entry.y = header.y;
+        entry.w = header.w;
+        entry.h = header.h;
+        entries.push_back(entry);
+
+        buffer.insert(buffer.end(), (const char *)&header, (const char *)&header + sizeof(header));
+        buffer.insert(buffer.end(), path.begin(), path.end());
+        buffer.insert(buffer.end(), encoded.begin(), encoded.end());
+        size += sizeof(header) + path.size() + encoded.size();
+
+        if (buffer.size() >= FLUSH_BYTES)
+        {
+            flush();
+        }
+
+        if (size >= segment_bytes && finish_segment())
+        {
+            seq++;
+            start_segment();
+        }
+
+        return !failed;
+    } // add
+
+    bool ArchiveWriter::sync()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (fd < 0)
+        {
+            return !failed;
+        }
+
+        if (flush() && fdatasync(fd) != 0)
+        {
+            failed = true;
+        }
+        return !failed;
+    } // sync
+
+    bool ArchiveWriter::close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (fd < 0)
+        {
+            return !failed;
+        }
+        return finish_segment();
+    } // close
+
+    ArchiveRecord::ArchiveRecord()
+    {
+        path = NULL;
+        path_size = 0;
+        data = NULL;
+        data_size = 0;
+    }
+
+    ArchiveReader::ArchiveReader()
+    {
+        total = 0;
+    }
+
+    ArchiveReader::~ArchiveReader()
+    {
+        close();
+    }
+
+    static bool map_file(const std::string &path, const char *&data, size_t &size)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            ::close(fd);
+            return false;
+        }
+
+        void *mapped = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED)
+        {
+            return false;
+        }
+
+        data = (const char *)mapped;
+        size = (size_t)st.st_size;
+        return true;
+    } // map_file
+
+    static bool valid_index(const char *idx, size_t idx_size, size_t seg_size)
+    {
+        if (idx_size < sizeof(IndexHeader) || memcmp(idx, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0)
+        {
+            return false;
+        }
+
+        const IndexHeader *header = (const IndexHeader *)idx;
+        if (idx_size != sizeof(IndexHeader) + header->count * sizeof(ArchiveEntry))
+        {
+            return false;
+        }
+
+        // an index pointing past its segment would hand out wild pointers.
+        const ArchiveEntry *entries = (const ArchiveEntry *)(idx + sizeof(IndexHeader));
+        for (uint64_t i = 0; i < header->count; i++)
+        {
+            uint64_t end = entries[i].offset + sizeof(RecordHeader) + entries[i].path_size + entries[i].data_size;
+            if (end > seg_size)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    } // valid_index
+
+    bool ArchiveReader::open(const std::string &dir)
+    {
+        close();
+
+        std::vector<std::string> names = list_dir(dir);
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            if (!ends_with(names[i], ".idx"))
+            {
+                continue;
+            }
+
+            std::string base = dir + "/" + names[i].substr(0, names[i].size() - 4);
+            Segment segment;
+            if (!map_file(base + ".idx", segment.idx.data, segment.idx.size))
+            {
+                continue;
+            }
+
+            // empty segments have nothing to map and nothing to find.
+            if (!map_file(base + ".seg", segment.seg.data, segment.seg.size) ||
+                !valid_index(segment.idx.data, segment.idx.size, segment.seg.size))
+            {
+                munmap((void *)segment.idx.data, segment.idx.size);
+                if (segment.seg.data != NULL)
+                {
+                    munmap((void *)segment.seg.data, segment.seg.size);
+                }
+                continue;
+            }
+
+            segment.entries = (const ArchiveEntry *)(segment.idx.data + sizeof(IndexHeader));
+            segment.count = (size_t)((const IndexHeader *)segment.idx.data)->count;
+            segments.push_back(segment);
+            total += segment.count;
+        }
+
+        return true;
+    } // open
+
+    void ArchiveReader::close()
+    {
+        for (size_t i = 0; i < segments.size(); i++)
+        {
+            munmap((void *)segments[i].idx.data, segments[i].idx.size);
+            munmap((void *)segments[i].seg.data, segments[i].seg.size);
+        }
+        segments.clear();
+        total = 0;
+    } // close
+
+    size_t ArchiveReader::size() const
+    {
+        return total;
+    } // size
+
+    ArchiveRecord ArchiveReader::record(const Segment &segment, const ArchiveEntry &entry) const
+    {
+        const char *start = segment.seg.data + entry.offset + sizeof(RecordHeader);
+
+        ArchiveRecord r;
+        r.path = start;
+        r.path_size = entry.path_size;
+        r.data = (const uchar *)start + entry.path_size;
+        r.data_size = entry.data_size;
+        r.details = ImageDetails(entry.x, entry.y, entry.h, entry.w);
+        return r;
+    } // record
+
+    ArchiveRecord ArchiveReader::at(size_t i) const
+    {
+        for (size_t s = 0; s < segments.size(); s++)
+        {
+            if (i < segments[s].count)
+            {
+                return record(segments[s], segments[s].entries[i]);
+            }
+            i -= segments[s].count;
+        }
+        return ArchiveRecord();
+    } // at
+
+    bool ArchiveReader::find(const std::string &path, ArchiveRecord &found) const
+    {
+        ArchiveEntry probe = ArchiveEntry();
+        probe.key = path_hash(path.data(), path.size());
+
+        for (size_t s = 0; s < segments.size(); s++)
+        {
+            const Segment &segment = segments[s];
+            const ArchiveEntry *end = segment.entries + segment.count;
+
+            // hashes can collide, so check the stored path of each match.
+            const ArchiveEntry *e = std::lower_bound(segment.entries, end, probe, by_key);
+            for (; e != end && e->key == probe.key; ++e)
+            {
+                ArchiveRecord r = record(segment, *e);
+                if (r.path_size == path.size() && memcmp(r.path, path.data(), path.size()) == 0)
+                {
+                    found = r;
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    } // find
+
+    static bool repair_segment(const std::string &base)
+    {
+        std::string seg = base + ".seg";
+        std::ifstream in(seg.c_str(), std::ios::binary);
+        struct stat st;
+        if (!in.is_open() || stat(seg.c_str(), &st) != 0)
+        {
+            return false;
+        }
+
+        std::vector<ArchiveEntry> entries;
+        uint64_t offset = 0;
+        RecordHeader header;
+        std::vector<char> path;
+        while (in.read((char *)&header, sizeof(header)) && header.magic == RECORD_MAGIC)
+        {
+            uint64_t end = offset + sizeof(header) + header.path_size + header.data_size;
+            path.resize(header.path_size);
+            if (end > (uint64_t)st.st_size || !in.read(path.data(), path.size()) ||
+                !in.seekg(header.data_size, std::ios::cur))
+            {
+                break;
+            }
+
+            ArchiveEntry entry;
+            entry.key = path_hash(path.data(), path.size());
+            entry.offset = offset;
+            entry.path_size = header.path_size;
+            entry.data_size = header.data_size;
+            entry.x = header.x;
+            entry.y = header.y;
+            entry.w = header.w;
+            entry.h = header.h;
+            entries.push_back(entry);
+
+            offset = end;
+        }
+        in.close();
+
+        // cut a torn record so later appends can't be misread after it.
+        return truncate(seg.c_str(), (off_t)offset) == 0 && write_index(base + ".idx", entries);
+    } // repair_segment
+
+    static bool segment_of(const std::string &file, const std::string &name)
+    {
+        // <name>-<seq>.seg, so crops-1-of-4 doesn't claim crops-1-of-40's.
+        std::string prefix = name + "-";
+        if (file.compare(0, prefix.size(), prefix) != 0 || !ends_with(file, ".seg"))
+        {
+            return false;
+        }
+
+        std::string seq = file.substr(prefix.size(), file.size() - prefix.size() - 4);
+        return !seq.empty() && seq.find_first_not_of("0123456789") == std::string::npos;
+    } // segment_of
+
+    int repair_archive(const std::string &dir, const std::string &name)
+    {
+        int repaired = 0;
+
+        std::vector<std::string> names = list_dir(dir);
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            if (!ends_with(names[i], ".seg") || (!name.empty() && !segment_of(names[i], name)))
+            {
+                continue;
+            }
+
+            std::string base = dir + "/" + names[i].substr(0, names[i].size() - 4);
+            struct stat st;
+            if (stat((base + ".idx").c_str(), &st) == 0)
+            {
+                continue;
+            }
+
+            if (!repair_segment(base))
+            {
+                return -1;
+            }
+            repaired++;
+        }
+
+        return repaired;
+    } // repair_archive
+
+} // namespace ImageDetector
@@ -0,0 +1,170 @@
+#ifndef IMAGE_DETECTOR_ARCHIVE_H
+#define IMAGE_DETECTOR_ARCHIVE_H
+
+#include "ImageDetector.h"
+
+#include <stdint.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace ImageDetector
+{
+    /**
+     * One crop's index record, stored as is in .idx files so readers can use
+     * the mapped file directly. Fields are in host byte order.
+     */
+    class ArchiveEntry
+    {
+    public:
+        // FNV-1a of the source path; .idx files are sorted by it.
+        uint64_t key;
+
+        // where the crop's record starts in its segment.
+        uint64_t offset;
+
+        uint32_t path_size;
+        uint32_t data_size;
+
+        // the crop's place in the source image.
+        int32_t x;
+        int32_t y;
+        int32_t w;
+        int32_t h;
+    };
+
+    /**
+     * Appends crops to large segment files under dir, named
+     * <name>-<seq>.seg, each with a sorted <name>-<seq>.idx written when the
+     * segment is closed. Records are buffered and written sequentially with
+     * O_APPEND. add may be called from several threads; separate processes
+     * should each use their own name, though a segment is never shared even
+     * when they don't.
+     */
+    class ArchiveWriter
+    {
+    public:
+        ArchiveWriter();
+        ~ArchiveWriter();
+
+        /**
+         * Starts the first segment. Existing segments are never reused, the
+         * sequence number continues after the highest one found.
+         */
+        bool open(const std::string &dir, const std::string &name, size_t segment_bytes = (size_t)1 << 30);
+
+        /**
+         * Appends an encoded crop of the image at path. Returns false once any
+         * write has failed.
+         */
+        bool add(const std::string &path, const ImageDetails &details, const std::vector<uchar> &encoded);
+
+        /**
+         * Writes what is buffered and waits for it to reach the disk, so
+         * everything added so far survives a kill once it returns. The index
+         * is still only written by close, see repair_archive.
+         */
+        bool sync();
+
+        /**
+         * Writes what is buffered and the index of the open segment.
+         */
+        bool close();
+
+    private:
+        bool start_segment();
+        bool flush();
+        bool finish_segment();
+
+        std::mutex mutex;
+        std::string dir;
+        std::string name;
+        size_t segment_bytes;
+
+        int seq;
+        int fd;
+        uint64_t size;
+        std::vector<char> buffer;
+        std::vector<ArchiveEntry> entries;
+        bool failed;
+    };
+
+    /**
+     * A crop inside a mapped segment. The pointers stay valid while the
+     * ArchiveReader is open; cv::imdecode(cv::Mat(1, data_size, CV_8U,
+     * (void *)data), ...) decodes it without copying.
+     */
+    class ArchiveRecord
+    {
+    public:
+        ArchiveRecord();
+
+        const char *path;
+        size_t path_size;
+        const uchar *data;
+        size_t data_size;
+        ImageDetails details;
+    };
+
+    /**
+     * Maps every indexed segment under an archive directory.
+     */
+    class ArchiveReader
+    {
+    public:
+        ArchiveReader();
+        ~ArchiveReader();
+
+        bool open(const std::string &dir);
+        void close();
+
+        size_t size() const;
+
+        /**
+         * Record i of size(), in segment order. Past the end the record is
+         * empty, with NULL pointers and zero sizes.
+         */
+        ArchiveRecord at(size_t i) const;
+
+        /**
+         * Looks path up by binary search in each index. Returns false if no
+         * segment has it.
+         */
+        bool find(const std::string &path, ArchiveRecord &record) const;
+
+    private:
+        class Mapping
+        {
+        public:
+            const char *data;
+            size_t size;
+        };
+
+        class Segment
+        {
+        public:
+            Mapping seg;
+            Mapping idx;
+            const ArchiveEntry *entries;
+            size_t count;
+        };
+
+        ArchiveRecord record(const Segment &segment, const ArchiveEntry &entry) const;
+
+        std::vector<Segment> segments;
+        size_t total;
+    };
+
+    /**
+     * Rebuilds the index of any segment left without one by a killed writer,
+     * dropping a torn last record. Only run it while nothing is writing to
+     * dir. With name set, only that writer's <name>-<seq>.seg segments are
+     * touched, which is safe while other writers share dir so long as none
+     * uses name. Returns the number of segments repaired, -1 on failure.
+     */
+    int repair_archive(const std::string &dir, const std::string &name = "");
+
+} // namespace ImageDetector
+
+#endif // IMAGE_DETECTOR_ARCHIVE_H
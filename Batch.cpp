@@ -0,0 +1,635 @@
+#include "Batch.h"
+#include "EdgeScore.h"
+#include "ImageHeader.h"
+#include "MatPool.h"
+#include "RunLength.h"
+#include "Trace.h"
+
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+namespace ImageDetector
+{
+    // decoder state, contour storage and the like that doesn't scale with the
+    // image closely enough to estimate.
+    static const size_t DECODER_SLACK = 8 * 1024 * 1024;
+
+    // decode plans from most to least faithful. Color keeps results identical
+    // to detect_v2; the rest trade fidelity for a smaller peak.
+    static const int PLAN_COUNT = 5;
+    static const int plan_flags[PLAN_COUNT] = {
+        cv::IMREAD_COLOR,
+        cv::IMREAD_GRAYSCALE,
+        cv::IMREAD_REDUCED_GRAYSCALE_2,
+        cv::IMREAD_REDUCED_GRAYSCALE_4,
+        cv::IMREAD_REDUCED_GRAYSCALE_8,
+    };
+    static const int plan_reduction[PLAN_COUNT] = {1, 1, 2, 4, 8};
+
+    // peak bytes per decoded pixel. Color is the 3 channel decode plus the
+    // mask it converts into; once the color buffer is freed the mask, its
+    // inverse and findContours' copy are all single channel.
+    static const double plan_bytes_per_pixel[PLAN_COUNT] = {5, 4, 4, 4, 4};
+
+    // edge verification adds two Sobel planes and two int prefix sum planes.
+    static const double EDGE_BYTES_PER_PIXEL = 12;
+
+    // images whose headers are read to estimate the batch's typical size.
+    static const size_t SPLIT_SAMPLES = 16;
+
+    // racing holds the shared gray copy plus every strategy's working masks
+    // at once.
+    static const double RACE_BYTES_PER_PIXEL = 6;
+
+    // archiving keeps the decoded image until the crop is encoded, and a
+    // hinted pass keeps it for the whole frame fallback. Either way that is
+    // at most the 3 channel decode again.
+    static const double KEEP_BYTES_PER_PIXEL = 3;
+
+    /**
+     * Counting semaphore over bytes. A request larger than the whole budget is
+     * let through once nothing else is in flight so it can't wait forever.
+     */
+    class MemoryBudget
+    {
+    public:
+        MemoryBudget(size_t limit) : limit(limit), used(0) {}
+
+        void acquire(size_t bytes)
+        {
+            if (limit == 0)
+            {
+                return;
+            }
+
+            std::unique_lock<std::mutex> lock(mutex);
+            while (used > 0 && used + bytes > limit)
+            {
+                freed.wait(lock);
+            }
+            used += bytes;
+        }
+
+        void release(size_t bytes)
+        {
+            if (limit == 0)
+            {
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            used -= bytes;
+            freed.notify_all();
+        }
+
+    private:
+        size_t limit;
+        size_t used;
+        std::mutex mutex;
+        std::condition_variable freed;
+    };
+
+    BatchOptions::BatchOptions()
+    {
+        workers = 0;
+        inner_threads = 0;
+        pin = false;
+        memory_budget = 0;
+        race = false;
+        archive = NULL;
+        crop_format = ".png";
+        stop = NULL;
+    }
+
+    BatchResult::BatchResult()
+    {
+        ok = false;
+        hinted = false;
+        reduction = 1;
+        footprint = 0;
+        decode_ms = 0;
+        detect_ms = 0;
+        ms = 0;
+    }
+
+    static size_t plan_footprint(cv::Size size, ImageFormat format, int plan, const BatchOptions &opts, bool keep)
+    {
+        double f = plan_reduction[plan];
+        double full = size.width * (double)size.height;
+        double pixels = full / (f * f);
+        double per_pixel = plan_bytes_per_pixel[plan] +
+                           (opts.detect.edge_verify && !opts.race ? EDGE_BYTES_PER_PIXEL : 0) +
+                           (opts.race ? RACE_BYTES_PER_PIXEL : 0) +
+                           (keep ? KEEP_BYTES_PER_PIXEL : 0);
+
+        // only libjpeg scales while decoding. Every other decoder builds the
+        // full size gray image and resizes it, so that plane briefly sits next
+        // to the reduced one.
+        double resize = f > 1 && format != FORMAT_JPEG ? full : 0;
+
+        return (size_t)(pixels * per_pixel + resize) + DECODER_SLACK;
+    } // plan_footprint
+
+    static bool read_file(const std::string &path, std::vector<uchar> &bytes)
+    {
+        std::ifstream in(path.c_str(), std::ios::binary);
+        if (!in.is_open())
+        {
+            return false;
+        }
+
+        in.seekg(0, std::ios::end);
+        bytes.resize((size_t)in.tellg());
+        in.seekg(0, std::ios::beg);
+        in.read((char *)bytes.data(), bytes.size());
+
+        return in.good() && !bytes.empty();
+    } // read_file
+
+    /**
+     * Runs the configured detection path over local's search region of a
+     * decoded image, leaving the result in decoded coordinates. Unless keep is
+     * set the image is freed as soon as the mask exists. A race holds on to
+     * charge until its last strategy is done.
+     */
+    static void detect_decoded(cv::Mat &img, const DetectOptions &local, const BatchOptions &opts, bool keep,
+                               const std::shared_ptr<void> &charge, BatchResult &r)
+    {
+        cv::Rect region = search_region(img.size(), local);
+        cv::Mat view = img(region);
+        if (!keep)
+        {
+            img.release();
+        }
+
+        // every path starts from gray, so convert once here and let the color
+        // buffer go before the median blur rather than after preprocess.
+        if (view.channels() != 1)
+        {
+            TraceSpan span("gray");
+            cv::Mat gray;
+            gray.allocator = pool_allocator(local.huge_pages, local.pooled);
+            cv::cvtColor(view, gray, cv::COLOR_BGR2GRAY);
+            view = gray;
+        }
+
+        // edges are scored in decoded coordinates, so the corners are only
+        // scaled up by the reduction afterwards either way. The race
+        // strategies don't verify edges, so they aren't built there.
+        bool verify = local.edge_verify && !opts.race;
+        EdgeIntegrals edges = EdgeIntegrals();
+        if (verify)
+        {
+            build_edge_integrals(view, edges);
+        }
+        const EdgeIntegrals *edges_ptr = verify ? &edges : NULL;
+
+        // the decoded image is only needed to build the mask.
+        if (opts.race)
+        {
+            RaceOptions racing = opts.racing;
+            racing.hold = charge;
+
+            RaceResult raced = RaceResult();
+            race_detect(view, local, racing, raced);
+            view.release();
+
+            r.details = raced.details;
+            r.stats.inverted = raced.inverted;
+            r.strategy = raced.winner;
+        }
+        else if (local.run_length)
+        {
+            RunMask runs = RunMask();
+            preprocess_runs(view, runs, local);
+            view.release();
+
+            r.details = detect_runs(runs, local, r.stats, edges_ptr);
+        }
+        else
+        {
+            cv::Mat mask;
+            mask.allocator = pool_allocator(local.huge_pages, local.pooled);
+            preprocess(view, mask, local);
+            view.release();
+
+            r.details = detect_mask(mask, local, r.stats, edges_ptr);
+            mask.release();
+        }
+
+        offset_details(r.details, region);
+    } // detect_decoded
+
+    /**
+     * Appends the found square, cut from the decoded image, to opts.archive
+     * under the image's path. Only a full resolution color decode is
+     * archived; a crop from a reduced or gray decode would not match the full
+     * resolution rectangle stored with it, so it is recorded as "reduced".
+     */
+    static void archive_crop(const std::string &path, const cv::Mat &img, const BatchOptions &opts,
+                             BatchResult &r)
+    {
+        cv::Rect square(r.details.x, r.details.y, r.details.w, r.details.h);
+        square = square & cv::Rect(0, 0, img.cols, img.rows);
+        if (square.area() == 0)
+        {
+            return;
+        }
+
+        if (r.reduction != 1 || img.channels() != 3)
+        {
+            r.crop = "reduced";
+            return;
+        }
+
+        // encoded outside the writer's lock, only the append is serialized.
+        // imencode throws rather than failing for a format it has no encoder
+        // for.
+        std::vector<uchar> encoded;
+        bool encoded_ok = false;
+        {
+            TraceSpan span("encode crop");
+            try
+            {
+                encoded_ok = cv::imencode(opts.crop_format, img(square), encoded);
+            }
+            catch (const cv::Exception &)
+            {
+                encoded_ok = false;
+            }
+        }
+
+        if (!encoded_ok)
+        {
+            r.crop = "failed";
+            return;
+        }
+
+        TraceSpan span("write");
+        r.crop = opts.archive->add(path, r.details, encoded) ? "archived" : "failed";
+    } // archive_crop
+
+    static void process(const std::string &path, const BatchOptions &opts, size_t limit,
+                        const std::shared_ptr<MemoryBudget> &budget, BatchResult &r)
+    {
+        r.path = path;
+
+        // pick the most faithful plan that fits. Without a readable header
+        // the image gets the whole budget to itself. The encoded bytes are
+        // held until decoding finishes so they count too.
+        cv::Size size;
+        ImageFormat format;
+        bool known = read_image_size(path, size, format);
+        int plan = 0;
+        r.footprint = limit;
+
+        struct stat st;
+        size_t file_bytes = stat(path.c_str(), &st) == 0 ? (size_t)st.st_size : 0;
+
+        // a hint's band is tried first, keeping the image for the full frame
+        // fallback.
+        const LayoutHint *hint = find_hint(opts.hints, hint_source(path));
+        bool keep = opts.archive != NULL || hint != NULL;
+
+        if (known)
+        {
+            for (plan = 0; plan < PLAN_COUNT; plan++)
+            {
+                r.footprint = plan_footprint(size, format, plan, opts, keep) + file_bytes;
+                if (limit == 0 || r.footprint <= limit || plan == PLAN_COUNT - 1)
+                {
+                    break;
+                }
+            }
+        }
+
+        if (limit > 0 && r.footprint > limit)
+        {
+            r.footprint = limit;
+        }
+
+        {
+            TraceSpan span("admit");
+            budget->acquire(r.footprint);
+        }
+
+        // losing race strategies keep the gray copy and their pools a little
+        // past race_detect, so the bytes go back once the last holder is done.
+        size_t footprint = r.footprint;
+        std::shared_ptr<void> charge(nullptr, [budget, footprint](void *) { budget->release(footprint); });
+
+        TraceSpan span("image");
+        int64 start = cv::getTickCount();
+
+        cv::Mat img;
+        {
+            std::vector<uchar> bytes;
+            bool read = false;
+            {
+                TraceSpan read_span("read");
+                read = read_file(path, bytes);
+            }
+
+            if (read)
+            {
+                TraceSpan decode_span("imdecode");
+                img = cv::imdecode(bytes, plan_flags[plan]);
+            }
+        }
+
+        int64 decoded = cv::getTickCount();
+        r.decode_ms = (decoded - start) * 1000.0 / cv::getTickFrequency();
+
+        if (!img.empty())
+        {
+            r.ok = true;
+            r.reduction = plan_reduction[plan];
+            r.frame = known ? size : img.size();
+
+            // the profile's class is picked by the size actually decoded, so
+            // its scale isn't applied on top of a reduced decode as if the
+            // image were still full size.
+            DetectOptions local = opts.detect;
+            apply_profile(opts.profile, img.size(), local);
+            local.min_area /= r.reduction * r.reduction;
+
+            if (hint != NULL)
+            {
+                DetectOptions hinted = local;
+                apply_hint(*hint, img.size(), hinted);
+                detect_decoded(img, hinted, opts, true, charge, r);
+                r.hinted = r.details.area() > 0;
+            }
+
+            if (!r.hinted)
+            {
+                detect_decoded(img, local, opts, opts.archive != NULL, charge, r);
+            }
+
+            if (opts.archive != NULL)
+            {
+                archive_crop(path, img, opts, r);
+                img.release();
+            }
+
+            r.details.x *= r.reduction;
+            r.details.y *= r.reduction;
+            r.details.w *= r.reduction;
+            r.details.h *= r.reduction;
+        }
+
+        int64 end = cv::getTickCount();
+        r.detect_ms = (end - decoded) * 1000.0 / cv::getTickFrequency();
+        r.ms = (end - start) * 1000.0 / cv::getTickFrequency();
+
+        charge.reset();
+    } // process
+
+    ThreadSplit plan_batch_threads(const std::vector<std::string> &paths, const BatchOptions &opts)
+    {
+        double megapixels = 0;
+        int known = 0;
+        for (size_t i = 0; i < paths.size() && i < SPLIT_SAMPLES; i++)
+        {
+            cv::Size size;
+            if (read_image_size(paths[i], size))
+            {
+                megapixels += size.width * (double)size.height / 1e6;
+                known++;
+            }
+        }
+
+        int cores = available_cores();
+        ThreadSplit split = plan_threads(cores, paths.size(), known > 0 ? megapixels / known : 0);
+
+        // a fixed side gets its way and the other one takes what is left, see
+        // plan_threads.
+        if (opts.workers > 0)
+        {
+            split.workers = opts.workers;
+            split.inner = MAX(1, cores - split.workers + 1);
+        }
+        if (opts.inner_threads > 0)
+        {
+            split.inner = opts.inner_threads;
+            split.workers = opts.workers > 0 ? opts.workers : MAX(1, cores - split.inner + 1);
+        }
+
+        split.workers = MAX(1, MIN(split.workers, (int)paths.size()));
+        return split;
+    } // plan_batch_threads
+
+    void run_batch(const std::vector<std::string> &paths, const BatchOptions &opts, BatchCallback done)
+    {
+        ThreadSplit split = plan_batch_threads(paths, opts);
+        int workers = split.workers;
+
+        // OpenCV's pool and the race helpers have to exist before any worker
+        // is pinned, see set_inner_threads. A worker waiting on a race leaves
+        // its core to a helper, and one race still runs all its strategies at
+        // once.
+        int previous_threads = set_inner_threads(split.inner);
+        if (opts.race)
+        {
+            int racers = opts.racing.strategies.empty() ? (int)race_strategies().size()
+                                                        : (int)opts.racing.strategies.size();
+            start_race_helpers(MAX(split.workers, racers));
+        }
+        std::vector<std::vector<int>> nodes;
+        if (opts.pin)
+        {
+            nodes = numa_cpus();
+        }
+
+        // each worker's Mat pool is memory the budget has to cover, so cap the
+        // pools at a quarter of the budget between them.
+        size_t limit = opts.memory_budget;
+        size_t previous_pool_limit = 0;
+        if (limit > 0)
+        {
+            size_t pool_share = limit / 4 / workers;
+            previous_pool_limit = set_pool_limit(pool_share);
+            limit -= pool_share * workers;
+        }
+
+        // shared with losing race strategies, which can give their charge
+        // back after the worker has moved on, see process.
+        std::shared_ptr<MemoryBudget> budget = std::make_shared<MemoryBudget>(limit);
+        std::atomic<size_t> next(0);
+        std::mutex done_mutex;
+
+        std::vector<std::thread> threads;
+        for (int w = 0; w < workers; w++)
+        {
+            threads.push_back(std::thread([&, w]() {
+                trace_thread_name("worker " + std::to_string(w));
+
+                if (opts.pin)
+                {
+                    pin_thread(worker_cpus(nodes, w));
+                }
+
+                for (size_t i = next++; i < paths.size() && !(opts.stop != NULL && *opts.stop); i = next++)
+                {
+                    BatchResult r = BatchResult();
+                    process(paths[i], opts, limit, budget, r);
+
+                    std::lock_guard<std::mutex> lock(done_mutex);
+                    done(r);
+                }
+            }));
+        }
+
+        for (size_t t = 0; t < threads.size(); t++)
+        {
+            threads[t].join();
+        }
+
+        // the losing strategies of the last races may still be running.
+        if (opts.race)
+        {
+            stop_race_helpers();
+        }
+
+        set_inner_threads(previous_threads);
+        if (opts.memory_budget > 0)
+        {
+            set_pool_limit(previous_pool_limit);
+        }
+    } // run_batch
+
+    std::string json_string(const std::string &s)
+    {
+        std::string out = "\"";
+        for (size_t i = 0; i < s.size(); i++)
+        {
+            unsigned char c = s[i];
+            if (c == '"' || c == '\\')
+            {
+                out += '\\';
+                out += c;
+            }
+            else if (c < 0x20)
+            {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            }
+            else
+            {
+                out += c;
+            }
+        }
+        return out + "\"";
+    } // json_string
+
+    std::string result_json(const BatchResult &r)
+    {
+        ImageDetails found = r.details;
+        const char *status = !r.ok ? "unreadable" : found.area() > 0 ? "ok" : "not_found";
+
+        std::ostringstream out;
+        out << "{\"path\":" << json_string(r.path)
+            << ",\"status\":\"" << status << "\"";
+
+        if (r.ok)
+        {
+            out << ",\"frame\":{\"w\":" << r.frame.width
+                << ",\"h\":" << r.frame.height
+                << "},\"rect\":{\"x\":" << r.details.x
+                << ",\"y\":" << r.details.y
+                << ",\"w\":" << r.details.w
+                << ",\"h\":" << r.details.h
+                << "},\"polarity\":\"" << (r.stats.inverted ? "inverted" : "normal") << "\""
+                << ",\"reduction\":" << r.reduction
+                << ",\"early_exit\":" << (r.stats.early_exit ? "true" : "false")
+                << ",\"hinted\":" << (r.hinted ? "true" : "false");
+
+            if (!r.strategy.empty())
+            {
+                out << ",\"strategy\":" << json_string(r.strategy);
+            }
+
+            if (!r.crop.empty())
+            {
+                out << ",\"crop\":" << json_string(r.crop);
+            }
+        }
+
+        out << ",\"timings\":{\"decode_ms\":" << r.decode_ms
+            << ",\"detect_ms\":" << r.detect_ms
+            << ",\"total_ms\":" << r.ms
+            << "}}";
+
+        return out.str();
+    } // result_json
+
+    bool parse_result_json(const std::string &line, BatchResult &r)
+    {
+        r = BatchResult();
+
+        const std::string prefix = "{\"path\":\"";
+        if (line.compare(0, prefix.size(), prefix) != 0 || line[line.size() - 1] != '}')
+        {
+            return false;
+        }
+
+        size_t i = prefix.size();
+        for (; i < line.size() && line[i] != '"'; i++)
+        {
+            if (line[i] != '\\')
+            {
+                r.path += line[i];
+            }
+            else if (i + 1 < line.size() && line[i + 1] == 'u' && i + 5 < line.size())
+            {
+                r.path += (char)strtol(line.substr(i + 2, 4).c_str(), NULL, 16);
+                i += 5;
+            }
+            else if (i + 1 < line.size())
+            {
+                r.path += line[++i];
+            }
+        }
+
+        if (i >= line.size())
+        {
+            return false;
+        }
+
+        // everything after the path is written by result_json alone, so the
+        // fields can be matched literally.
+        const std::string unreadable = ",\"status\":\"unreadable\"";
+        r.ok = line.compare(i + 1, unreadable.size(), unreadable) != 0;
+
+        size_t frame = line.find(",\"frame\":{", i);
+        if (frame != std::string::npos)
+        {
+            sscanf(line.c_str() + frame, ",\"frame\":{\"w\":%d,\"h\":%d", &r.frame.width, &r.frame.height);
+        }
+
+        int x = 0;
+        int y = 0;
+        int w = 0;
+        int h = 0;
+        size_t rect = line.find(",\"rect\":{", i);
+        if (rect != std::string::npos &&
+            sscanf(line.c_str() + rect, ",\"rect\":{\"x\":%d,\"y\":%d,\"w\":%d,\"h\":%d", &x, &y, &w, &h) == 4)
+        {
+            r.details = ImageDetails(x, y, h, w);
+        }
+
+        return true;
+    } // parse_result_json
+
+} // namespace ImageDetector
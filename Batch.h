@@ -0,0 +1,138 @@
+#ifndef IMAGE_DETECTOR_BATCH_H
+#define IMAGE_DETECTOR_BATCH_H
+
+#include "Archive.h"
+#include "ImageDetector.h"
+#include "LayoutHint.h"
+#include "Race.h"
+#include "ThreadBudget.h"
+#include "Tuning.h"
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace ImageDetector
+{
+    class BatchOptions
+    {
+    public:
+        BatchOptions();
+
+        // worker threads and OpenCV's shared inner threads, 0 to have
+        // plan_batch_threads pick them from the core count and image sizes.
+        int workers;
+        int inner_threads;
+
+        // pin each worker to a CPU of its own, round robin over NUMA nodes.
+        bool pin;
+
+        // bytes all in flight images may use together, 0 for no limit. Images
+        // are admitted on an estimate from their header dimensions and fall
+        // back to grayscale or reduced decoding when they would not fit.
+        size_t memory_budget;
+
+        DetectOptions detect;
+
+        // race the detection strategies per image instead of running detect's
+        // own pipeline, see race_detect.
+        bool race;
+        RaceOptions racing;
+
+        // applied per image on top of detect, empty for none.
+        TuningProfile profile;
+
+        // layout hints looked up by hint_source of each path. Images from a
+        // source with a hint search its band first, see detect_hinted.
+        HintProfile hints;
+
+        // appends each found square's crop, encoded as crop_format, when set.
+        // Not owned; the caller opens and closes it.
+        ArchiveWriter *archive;
+        std::string crop_format;
+
+        // once set, workers take no new images and run_batch returns when
+        // the ones in flight are done. Not owned, NULL for none.
+        const std::atomic<bool> *stop;
+    };
+
+    class BatchResult
+    {
+    public:
+        BatchResult();
+
+        std::string path;
+        ImageDetails details;
+
+        // false when the image could not be read.
+        bool ok;
+
+        // source image size, whatever it was decoded at.
+        cv::Size frame;
+
+        // set when the answer came from inside a layout hint.
+        bool hinted;
+
+        // 1 for a full resolution decode, otherwise the IMREAD_REDUCED factor.
+        int reduction;
+
+        // bytes reserved against the memory budget for this image.
+        size_t footprint;
+
+        DetectStats stats;
+
+        // the race_detect winner when racing.
+        std::string strategy;
+
+        // when archiving and a square was found: "archived", "reduced" when
+        // the image had to be decoded too small or in gray to store its crop,
+        // or "failed" when it could not be encoded or written.
+        std::string crop;
+
+        // wall time for reading and decoding, detection, and the whole image.
+        double decode_ms;
+        double detect_ms;
+        double ms;
+    };
+
+    /**
+     * Called once per image. Calls are serialized so the callback needs no
+     * locking of its own, but they arrive in completion order.
+     */
+    typedef std::function<void(const BatchResult &)> BatchCallback;
+
+    /**
+     * s as a quoted JSON string.
+     */
+    std::string json_string(const std::string &s);
+
+    /**
+     * The result as a single line JSON object, path first. Fields after status
+     * are left out for unreadable images.
+     */
+    std::string result_json(const BatchResult &r);
+
+    /**
+     * Reads back the path, status, frame and rect of a line written by
+     * result_json. Returns false if the line isn't one. Lines from before
+     * the frame was recorded come back with an empty frame.
+     */
+    bool parse_result_json(const std::string &line, BatchResult &r);
+
+    /**
+     * The thread split run_batch will use for paths, with any fixed workers or
+     * inner_threads in opts kept. Sizes come from the headers of the first few
+     * images.
+     */
+    ThreadSplit plan_batch_threads(const std::vector<std::string> &paths, const BatchOptions &opts);
+
+    /**
+     * Runs detect_v2 over every path on a pool of worker threads. OpenCV's
+     * thread count is set for the split while it runs and restored after.
+     */
+    void run_batch(const std::vector<std::string> &paths, const BatchOptions &opts, BatchCallback done);
+
+} // namespace ImageDetector
+
+#endif // IMAGE_DETECTOR_BATCH_H
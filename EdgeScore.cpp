@@ -0,0 +1,199 @@
+#include "EdgeScore.h"
+#include "Trace.h"
+
+#include <stdlib.h>
+
+namespace ImageDetector
+{
+    // a 3x3 Sobel answers a step of c gray levels with 4c.
+    static const double SOBEL_GAIN = 4.0;
+
+    void build_edge_integrals(const cv::Mat &src, EdgeIntegrals &dst)
+    {
+        TraceSpan span("edge_integrals");
+
+        cv::Mat gray = src;
+        if (src.channels() != 1)
+        {
+            cv::cvtColor(src, gray, cv::COLOR_BGR2GRAY);
+        }
+
+        cv::Mat grad_x;
+        cv::Mat grad_y;
+        cv::Sobel(gray, grad_x, CV_16S, 1, 0);
+        cv::Sobel(gray, grad_y, CV_16S, 0, 1);
+
+        // a row of 255 * 4 * cols stays well inside an int for any image we
+        // could decode, which a full 2D integral would not.
+        dst.horizontal.create(gray.rows, gray.cols + 1, CV_32S);
+        dst.vertical.create(gray.rows + 1, gray.cols, CV_32S);
+
+        int *top = dst.vertical.ptr<int>(0);
+        for (int x = 0; x < gray.cols; x++)
+        {
+            top[x] = 0;
+        }
+
+        for (int y = 0; y < gray.rows; y++)
+        {
+            const short *gx = grad_x.ptr<short>(y);
+            const short *gy = grad_y.ptr<short>(y);
+            int *h = dst.horizontal.ptr<int>(y);
+            const int *v_above = dst.vertical.ptr<int>(y);
+            int *v = dst.vertical.ptr<int>(y + 1);
+
+            h[0] = 0;
+            for (int x = 0; x < gray.cols; x++)
+            {
+                h[x + 1] = h[x] + abs(gy[x]);
+                v[x] = v_above[x] + abs(gx[x]);
+            }
+        }
+    } // build_edge_integrals
+
+    static double row_score(const EdgeIntegrals &edges, int y, int x0, int x1)
+    {
+        y = MAX(0, MIN(edges.horizontal.rows - 1, y));
+        x0 = MAX(0, x0);
+        x1 = MIN(edges.horizontal.cols - 2, x1);
+        if (x1 < x0)
+        {
+            return 0;
+        }
+
+        const int *h = edges.horizontal.ptr<int>(y);
+        return (h[x1 + 1] - h[x0]) / (SOBEL_GAIN * (x1 - x0 + 1));
+    } // row_score
+
+    static double col_score(const EdgeIntegrals &edges, int x, int y0, int y1)
+    {
+        x = MAX(0, MIN(edges.vertical.cols - 1, x));
+        y0 = MAX(0, y0);
+        y1 = MIN(edges.vertical.rows - 2, y1);
+        if (y1 < y0)
+        {
+            return 0;
+        }
+
+        return (edges.vertical.at<int>(y1 + 1, x) - edges.vertical.at<int>(y0, x)) / (SOBEL_GAIN * (y1 - y0 + 1));
+    } // col_score
+
+    double score_square(const EdgeIntegrals &edges, const std::vector<cv::Point> &sq)
+    {
+        if (sq.size() != 4)
+        {
+            return 0;
+        }
+
+        // index 0 - top left, 2 - bottom right, see max_square_edges
+        int x0 = sq[0].x;
+        int y0 = sq[0].y;
+        int x1 = sq[2].x;
+        int y1 = sq[2].y;
+
+        // Sobel sees no gradient across the frame's own border, so sides lying
+        // on it have nothing to score and are left out of the mean.
+        double total = 0;
+        int measured = 0;
+        if (y0 > 0)
+        {
+            total += row_score(edges, y0, x0, x1);
+            measured++;
+        }
+        if (y1 < edges.horizontal.rows - 1)
+        {
+            total += row_score(edges, y1, x0, x1);
+            measured++;
+        }
+        if (x0 > 0)
+        {
+            total += col_score(edges, x0, y0, y1);
+            measured++;
+        }
+        if (x1 < edges.vertical.cols - 1)
+        {
+            total += col_score(edges, x1, y0, y1);
+            measured++;
+        }
+
+        return measured > 0 ? total / measured : 0;
+    } // score_square
+
+    static int best_row(const EdgeIntegrals &edges, int y, int x0, int x1, int radius)
+    {
+        int best = y;
+        double best_score = row_score(edges, y, x0, x1);
+        for (int d = -radius; d <= radius; d++)
+        {
+            double score = row_score(edges, y + d, x0, x1);
+            if (score > best_score)
+            {
+                best_score = score;
+                best = y + d;
+            }
+        }
+        return MAX(0, MIN(edges.horizontal.rows - 1, best));
+    } // best_row
+
+    static int best_col(const EdgeIntegrals &edges, int x, int y0, int y1, int radius)
+    {
+        int best = x;
+        double best_score = col_score(edges, x, y0, y1);
+        for (int d = -radius; d <= radius; d++)
+        {
+            double score = col_score(edges, x + d, y0, y1);
+            if (score > best_score)
+            {
+                best_score = score;
+                best = x + d;
+            }
+        }
+        return MAX(0, MIN(edges.vertical.cols - 1, best));
+    } // best_col
+
+    void refine_square(const EdgeIntegrals &edges, std::vector<cv::Point> &sq, int radius)
+    {
+        if (sq.size() != 4)
+        {
+            return;
+        }
+
+        int x0 = sq[0].x;
+        int y0 = sq[0].y;
+        int x1 = sq[2].x;
+        int y1 = sq[2].y;
+
+        // score each side over the original span of the other axis so the
+        // four searches don't depend on each other's result.
+        int top = best_row(edges, y0, x0, x1, radius);
+        int bottom = best_row(edges, y1, x0, x1, radius);
+        int left = best_col(edges, x0, y0, y1, radius);
+        int right = best_col(edges, x1, y0, y1, radius);
+
+        if (top >= bottom || left >= right)
+        {
+            return;
+        }
+
+        sq[0] = cv::Point(left, top);
+        sq[1] = cv::Point(left, bottom);
+        sq[2] = cv::Point(right, bottom);
+        sq[3] = cv::Point(right, top);
+    } // refine_square
+
+    void verify_squares(const EdgeIntegrals &edges, std::vector<std::vector<cv::Point>> &squares,
+                        int radius, double min_score)
+    {
+        size_t kept = 0;
+        for (size_t i = 0; i < squares.size(); i++)
+        {
+            refine_square(edges, squares[i], radius);
+            if (score_square(edges, squares[i]) >= min_score)
+            {
+                squares[kept++].swap(squares[i]);
+            }
+        }
+        squares.resize(kept);
+    } // verify_squares
+
+} // namespace ImageDetector
@@ -0,0 +1,50 @@
+#ifndef IMAGE_DETECTOR_EDGE_SCORE_H
+#define IMAGE_DETECTOR_EDGE_SCORE_H
+
+#include "ImageDetector.h"
+
+#include <vector>
+
+namespace ImageDetector
+{
+    /**
+     * Prefix sums of Sobel gradient magnitude. horizontal runs along each row
+     * over |d/dy| so the strength of any horizontal edge segment is a single
+     * subtraction; vertical does the same down each column over |d/dx|.
+     */
+    class EdgeIntegrals
+    {
+    public:
+        cv::Mat horizontal; // CV_32S, rows x (cols + 1)
+        cv::Mat vertical;   // CV_32S, (rows + 1) x cols
+    };
+
+    /**
+     * Builds the edge prefix sums for src, converting it to grayscale first if
+     * it isn't already. Same Sobel idea as do_sobel in scratch.cpp.
+     */
+    void build_edge_integrals(const cv::Mat &src, EdgeIntegrals &dst);
+
+    /**
+     * Mean edge strength along the sides of a square from max_square_edges,
+     * roughly in gray levels of contrast. Sides on the frame's border are
+     * left out; a square with all four there scores 0.
+     */
+    double score_square(const EdgeIntegrals &edges, const std::vector<cv::Point> &sq);
+
+    /**
+     * Moves each side of sq up to radius pixels to the row or column with the
+     * strongest edge along it.
+     */
+    void refine_square(const EdgeIntegrals &edges, std::vector<cv::Point> &sq, int radius);
+
+    /**
+     * Refines every square and drops the ones whose score falls below
+     * min_score.
+     */
+    void verify_squares(const EdgeIntegrals &edges, std::vector<std::vector<cv::Point>> &squares,
+                        int radius, double min_score);
+
+} // namespace ImageDetector
+
+#endif // IMAGE_DETECTOR_EDGE_SCORE_H
@@ -1,79 +1,305 @@
 #include "ImageDetector.h"
+#include "EdgeScore.h"
+#include "MatPool.h"
+#include "RunLength.h"
+#include "Trace.h"
 
 #include <stdio.h>
 
+#include <algorithm>
+#include <functional>
+
 namespace ImageDetector
 {
-    class ImageDetails
+    ImageDetails::ImageDetails()
+    {
+        x = 0;
+        y = 0;
+        h = 0;
+        w = 0;
+    }
+
+    ImageDetails::ImageDetails(int x, int y, int h, int w)
+    {
+        this->x = x;
+        this->y = y;
+        this->h = h;
+        this->w = w;
+    }
+
+    int ImageDetails::area()
+    {
+        return h * w;
+    }
+
+    DetectOptions::DetectOptions()
+    {
+        pooled = true;
+        huge_pages = false;
+        early_exit = false;
+        dominant_fraction = 0.5;
+        scale = 1.0;
+        blur_size = 5;
+        erode_size = 3;
+        epsilon = 0.02;
+        max_cosine = 0.3;
+        min_area = 1000;
+        max_area = 0;
+        min_aspect = 0;
+        max_aspect = 0;
+        run_length = false;
+        edge_verify = false;
+        refine_radius = 4;
+        min_edge_score = 8;
+        cancel = NULL;
+    }
+
+    DetectStats::DetectStats()
+    {
+        allocations = 0;
+        pool_hits = 0;
+        minor_faults = 0;
+        major_faults = 0;
+        early_exit = false;
+        inverted = false;
+    }
+
+    /**
+     * Candidate vectors kept per thread so their capacity carries over from one
+     * image to the next instead of being reallocated on every call.
+     */
+    class Scratch
     {
     public:
-        ImageDetails()
+        std::vector<std::vector<cv::Point>> maybe_squares;
+        std::vector<std::vector<cv::Point>> squares;
+    };
+
+    static thread_local Scratch scratch;
+
+    static cv::MatAllocator *allocator_for(const DetectOptions &opts)
+    {
+        // unpooled runs still go through the counting allocator so the stats
+        // can be compared side by side.
+        return pool_allocator(opts.huge_pages, opts.pooled);
+    } // allocator_for
+
+    static void record_stats(const PoolStats &before, DetectStats &stats)
+    {
+        PoolStats after = pool_stats();
+        stats.allocations = after.allocations - before.allocations;
+        stats.pool_hits = after.pool_hits - before.pool_hits;
+        stats.minor_faults = after.minor_faults - before.minor_faults;
+        stats.major_faults = after.major_faults - before.major_faults;
+    } // record_stats
+
+    static bool cancelled(const std::atomic<bool> *cancel)
+    {
+        return cancel != NULL && cancel->load(std::memory_order_relaxed);
+    } // cancelled
+
+    static double min_square_area(const DetectOptions &opts)
+    {
+        // the floor is in full resolution pixels.
+        return opts.min_area * opts.scale * opts.scale;
+    } // min_square_area
+
+    void restore_scale(std::vector<cv::Point> &sq, const DetectOptions &opts)
+    {
+        // map a downscaled mask's corners back onto the source image.
+        if (opts.scale != 1.0)
         {
-            x = 0;
-            y = 0;
-            h = 0;
-            w = 0;
+            for (size_t i = 0; i < sq.size(); i++)
+            {
+                sq[i].x = cvRound(sq[i].x / opts.scale);
+                sq[i].y = cvRound(sq[i].y / opts.scale);
+            }
         }
+    } // restore_scale
+
+    static int square_area(const std::vector<cv::Point> &sq)
+    {
+        // same measure largest_area ranks by.
+        return (sq[2].x - sq[0].x) * (sq[2].y - sq[0].y);
+    } // square_area
+
+    static bool within_limits(const std::vector<cv::Point> &sq, const DetectOptions &opts)
+    {
+        // sq is from max_square_edges, still in mask coordinates.
+        double w = (sq[2].x - sq[0].x) / opts.scale;
+        double h = (sq[2].y - sq[0].y) / opts.scale;
+        double aspect = w / MAX(h, 1.0);
+
+        return (opts.max_area <= 0 || w * h <= opts.max_area) &&
+               (opts.min_aspect <= 0 || aspect >= opts.min_aspect) &&
+               (opts.max_aspect <= 0 || aspect <= opts.max_aspect);
+    } // within_limits
 
-        ImageDetails(int x, int y, int h, int w)
+    void drop_outside_limits(std::vector<std::vector<cv::Point>> &squares, const DetectOptions &opts)
+    {
+        size_t kept = 0;
+        for (size_t i = 0; i < squares.size(); i++)
         {
-            this.x = x;
-            this.y = y;
-            this.h = h;
-            this.w = w;
+            if (within_limits(squares[i], opts))
+            {
+                squares[kept++].swap(squares[i]);
+            }
         }
+        squares.resize(kept);
+    } // drop_outside_limits
+
+    /**
+     * Early exit version of largest_square. Contours are visited largest
+     * bounding box first; a squared up quad never exceeds its contour's box so
+     * once the best square beats the next box nothing left can win. Returns
+     * true if it stopped before visiting every contour.
+     */
+    static bool largest_square_early(cv::Mat &mask, const DetectOptions &opts, std::vector<cv::Point> &dst)
+    {
+        TraceSpan span("find_squares");
 
-        int area()
+        dst.clear();
+
+        static thread_local std::vector<std::vector<cv::Point>> contours;
+        static thread_local std::vector<std::pair<int, size_t>> bounds;
+        static thread_local std::vector<cv::Point> approx;
+
+        cv::findContours(mask, contours, cv::RETR_LIST, cv::CHAIN_APPROX_SIMPLE);
+
+        bounds.clear();
+        for (size_t i = 0; i < contours.size(); i++)
         {
-            return h * w;
+            bounds.push_back(std::make_pair(cv::boundingRect(contours[i]).area(), i));
         }
+        std::sort(bounds.begin(), bounds.end(), std::greater<std::pair<int, size_t>>());
 
-        int x;
-        int y;
-        int h;
-        int w;
-    };
+        double dominant = mask.rows * (double)mask.cols * opts.dominant_fraction;
+        int l_area = 0;
 
-    ImageDetector::ImageDetails detect_v2(cv::Mat src)
-    {
-        // get two versions of the cropped images. Based on the incoming image
-        // and where ite was cropped from, the bitwise_not may do an inverse
-        // where not needed.
-        ImageDetails id_a = detect_inverse_optional(src, true);
-        ImageDetails id_b = detect_inverse_optional(src, false);
+        for (size_t k = 0; k < bounds.size(); k++)
+        {
+            if (cancelled(opts.cancel))
+            {
+                dst.clear();
+                return false;
+            }
 
-        return id_a.area() > id_b.area() ? id_a : id_b;
-    } // detect_v2
+            if (l_area > 0 && l_area >= bounds[k].first)
+            {
+                return true;
+            }
+
+            if (!is_square(contours[bounds[k].second], approx, opts.epsilon, min_square_area(opts), opts.max_cosine))
+            {
+                continue;
+            }
+
+            scratch.maybe_squares.assign(1, approx);
+            max_square_edges(scratch.maybe_squares, scratch.squares);
+
+            if (!within_limits(scratch.squares[0], opts))
+            {
+                continue;
+            }
+
+            int area = square_area(scratch.squares[0]);
+            if (area > l_area)
+            {
+                l_area = area;
+                dst = scratch.squares[0];
+            }
 
-    ImageDetector::ImageDetails detect_inverse_optional(cv::Mat src, bool inverse = false)
+            if (l_area > dominant)
+            {
+                return k + 1 < bounds.size();
+            }
+        }
+
+        return false;
+    } // largest_square_early
+
+    static int edge_radius(const DetectOptions &opts)
     {
-        cv::Mat dst;
-        src.copyTo(dst);
+        // a downscaled mask is off by up to a mask pixel, so always search at
+        // least that far.
+        return MAX(opts.refine_radius, (int)ceil(1.0 / opts.scale));
+    } // edge_radius
+
+    /**
+     * Picks the largest of scratch.squares, which are still in mask
+     * coordinates, that fits the size and aspect limits. With edges the
+     * candidates are mapped to the source first, snapped to their strongest
+     * edges and dropped if those edges are weak.
+     */
+    static void pick_square(const DetectOptions &opts, const EdgeIntegrals *edges, std::vector<cv::Point> &dst)
+    {
+        TraceSpan span("selection");
 
-        // apply some filters to get started
-        cv::cvtColor(dst, dst, cv::COLOR_BGR2GRAY);
-        cv::medianBlur(dst, dst, 5);
-        cv::threshold(dst, dst, 0, 500, cv::THRESH_TRIANGLE);
-        cv::morphologyEx(dst, dst, cv::MORPH_ERODE, cv::Mat());
+        drop_outside_limits(scratch.squares, opts);
 
-        if (inverse)
+        if (edges == NULL)
         {
-            cv::bitwise_not(dst, dst);
+            // get largest square.
+            largest_area(scratch.squares, dst);
+            restore_scale(dst, opts);
+            return;
+        }
+
+        for (size_t i = 0; i < scratch.squares.size(); i++)
+        {
+            restore_scale(scratch.squares[i], opts);
+        }
+
+        verify_squares(*edges, scratch.squares, edge_radius(opts), opts.min_edge_score);
+        largest_area(scratch.squares, dst);
+    } // pick_square
+
+    static bool largest_square(cv::Mat &mask, const DetectOptions &opts, const EdgeIntegrals *edges,
+                               std::vector<cv::Point> &dst)
+    {
+        if (opts.early_exit)
+        {
+            bool shortcut = largest_square_early(mask, opts, dst);
+            restore_scale(dst, opts);
+
+            if (edges == NULL || dst.empty())
+            {
+                return shortcut;
+            }
+
+            // the shortcut only stands if its square passes the same check
+            // pick_square applies, otherwise every candidate is looked at.
+            refine_square(*edges, dst, edge_radius(opts));
+            if (score_square(*edges, dst) >= opts.min_edge_score)
+            {
+                return shortcut;
+            }
+            dst.clear();
         }
 
         // find potential squares
-        std::vector<std::vector<cv::Point>> maybe_squares;
-        find_squares(dst, maybe_squares);
+        find_squares(mask, scratch.maybe_squares, opts.epsilon, min_square_area(opts), opts.max_cosine, opts.cancel);
 
         // find_squares sometimes returns rhombuses so we need to
         // "expand" the four corners to be the max x and y values of it.
-        std::vector<std::vector<cv::Point>> squares;
-        max_square_edges(maybe_squares, squares);
+        max_square_edges(scratch.maybe_squares, scratch.squares);
 
-        // get largest square.
-        std::vector<cv::Point> l_sq;
-        largest_area(squares, l_sq);
+        pick_square(opts, edges, dst);
+
+        return false;
+    } // largest_square
+
+    static void largest_square_runs(const RunMask &runs, const DetectOptions &opts, const EdgeIntegrals *edges,
+                                    std::vector<cv::Point> &dst)
+    {
+        find_squares_runs(runs, scratch.maybe_squares, opts.epsilon, min_square_area(opts), opts.max_cosine,
+                          opts.cancel);
+        max_square_edges(scratch.maybe_squares, scratch.squares);
+        pick_square(opts, edges, dst);
+    } // largest_square_runs
 
+    ImageDetails details_from_square(const std::vector<cv::Point> &l_sq)
+    {
         if (l_sq.size() != 4)
         {
             return ImageDetails();
@@ -83,44 +309,252 @@ namespace ImageDetector
         id.x = l_sq[0].x;
         id.y = l_sq[0].y;
         id.w = l_sq[3].x - l_sq[1].x;
-        id.h = l_sq[1].x - l_sq[0].x;
+        id.h = l_sq[1].y - l_sq[0].y;
+        return id;
+    } // details_from_square
+
+    ImageDetector::ImageDetails detect_v2(cv::Mat src)
+    {
+        DetectOptions opts = DetectOptions();
+        DetectStats stats = DetectStats();
+        return detect_v2(src, opts, stats);
+    } // detect_v2
+
+    ImageDetector::ImageDetails detect_v2(cv::Mat src, const DetectOptions &opts, DetectStats &stats)
+    {
+        // everything below only sees the searched region.
+        cv::Rect region = search_region(src.size(), opts);
+        src = src(region);
+
+        EdgeIntegrals edges = EdgeIntegrals();
+        if (opts.edge_verify)
+        {
+            build_edge_integrals(src, edges);
+        }
+        const EdgeIntegrals *edges_ptr = opts.edge_verify ? &edges : NULL;
+
+        if (opts.run_length)
+        {
+            RunMask runs = RunMask();
+            preprocess_runs(src, runs, opts);
+
+            ImageDetails id = detect_runs(runs, opts, stats, edges_ptr);
+            offset_details(id, region);
+            return id;
+        }
+
+        PoolStats before = pool_stats();
+
+        cv::Mat mask;
+        mask.allocator = allocator_for(opts);
+        preprocess(src, mask, opts);
+
+        ImageDetails id = detect_mask(mask, opts, stats, edges_ptr);
+        offset_details(id, region);
+
+        mask.release();
+        record_stats(before, stats);
+
         return id;
+    } // detect_v2
+
+    ImageDetector::ImageDetails detect_mask(cv::Mat &mask, const DetectOptions &opts, DetectStats &stats,
+                                            const EdgeIntegrals *edges)
+    {
+        PoolStats before = pool_stats();
+
+        // get two versions of the cropped images. Based on the incoming image
+        // and where ite was cropped from, the bitwise_not may do an inverse
+        // where not needed. Both polarities share the one filtered mask.
+        cv::Mat inverse;
+        inverse.allocator = allocator_for(opts);
+        cv::bitwise_not(mask, inverse);
+
+        std::vector<cv::Point> sq_a;
+        std::vector<cv::Point> sq_b;
+        stats.early_exit = largest_square(inverse, opts, edges, sq_a);
+
+        ImageDetails id_a = details_from_square(sq_a);
+        ImageDetails id_b = ImageDetails();
+
+        // with early exit on, a dominant square from the first polarity is
+        // taken as the answer and the second polarity is never traced. The
+        // mask only covers the roi, so dominance is judged against that.
+        double frame_area = mask.rows * (double)mask.cols / (opts.scale * opts.scale);
+        if (opts.early_exit && id_a.area() > frame_area * opts.dominant_fraction)
+        {
+            stats.early_exit = true;
+        }
+        else if (!cancelled(opts.cancel))
+        {
+            stats.early_exit = largest_square(mask, opts, edges, sq_b) || stats.early_exit;
+            id_b = details_from_square(sq_b);
+        }
+
+        inverse.release();
+        record_stats(before, stats);
+
+        stats.inverted = id_a.area() > id_b.area();
+        return stats.inverted ? id_a : id_b;
+    } // detect_mask
+
+    ImageDetector::ImageDetails detect_runs(const RunMask &runs, const DetectOptions &opts, DetectStats &stats,
+                                            const EdgeIntegrals *edges)
+    {
+        PoolStats before = pool_stats();
+
+        // same two polarities as detect_mask. Inverting runs only walks the
+        // gaps between them so it costs nothing like a bitwise_not.
+        RunMask inverse = RunMask();
+        invert_runs(runs, inverse);
+
+        std::vector<cv::Point> sq_a;
+        std::vector<cv::Point> sq_b;
+        largest_square_runs(inverse, opts, edges, sq_a);
+        if (!cancelled(opts.cancel))
+        {
+            largest_square_runs(runs, opts, edges, sq_b);
+        }
+
+        ImageDetails id_a = details_from_square(sq_a);
+        ImageDetails id_b = details_from_square(sq_b);
+
+        stats.early_exit = false;
+        record_stats(before, stats);
+
+        stats.inverted = id_a.area() > id_b.area();
+        return stats.inverted ? id_a : id_b;
+    } // detect_runs
+
+    ImageDetector::ImageDetails detect_inverse_optional(cv::Mat src, bool inverse)
+    {
+        DetectOptions opts = DetectOptions();
+
+        cv::Mat dst;
+        dst.allocator = allocator_for(opts);
+        preprocess(src, dst, opts);
+
+        if (inverse)
+        {
+            cv::bitwise_not(dst, dst);
+        }
+
+        std::vector<cv::Point> l_sq;
+        largest_square(dst, opts, NULL, l_sq);
+
+        return details_from_square(l_sq);
     } // detect_inverse_optional
 
     std::vector<cv::Point> detect(cv::Mat src)
     {
-        cv::Mat dst;
-        src.copyTo(dst);
+        DetectOptions opts = DetectOptions();
+        DetectStats stats = DetectStats();
+        return detect(src, opts, stats);
+    } // detect
 
-        // apply some filters to get started
-        cv::cvtColor(dst, dst, cv::COLOR_BGR2GRAY);
-        cv::medianBlur(dst, dst, 5);
-        cv::threshold(dst, dst, 0, 500, cv::THRESH_TRIANGLE);
-        cv::morphologyEx(dst, dst, cv::MORPH_ERODE, cv::Mat());
+    std::vector<cv::Point> detect(cv::Mat src, const DetectOptions &opts, DetectStats &stats)
+    {
+        EdgeIntegrals edges = EdgeIntegrals();
+        if (opts.edge_verify)
+        {
+            build_edge_integrals(src, edges);
+        }
+
+        PoolStats before = pool_stats();
+
+        cv::Mat dst;
+        dst.allocator = allocator_for(opts);
+        preprocess(src, dst, opts);
 
         // at this point, determine if the image is a dark or light mode UI.
         // background color must be black for this to work
-        if (first_row_is_white(dst))
+        stats.inverted = first_row_is_white(dst);
+        if (stats.inverted)
         {
             cv::bitwise_not(dst, dst);
         }
 
-        // find potential squares
-        std::vector<std::vector<cv::Point>> maybe_squares;
-        find_squares(dst, maybe_squares);
-
-        // find_squares sometimes returns rhombuses so we need to
-        // "expand" the four corners to be the max x and y values of it.
-        std::vector<std::vector<cv::Point>> squares;
-        max_square_edges(maybe_squares, squares);
-
-        // get largest square.
         std::vector<cv::Point> l_sq;
-        largest_area(squares, l_sq);
+        stats.early_exit = largest_square(dst, opts, opts.edge_verify ? &edges : NULL, l_sq);
+
+        dst.release();
+        record_stats(before, stats);
 
         return l_sq;
     } // detect
 
+    void preprocess(const cv::Mat &src, cv::Mat &dst)
+    {
+        preprocess(src, dst, DetectOptions());
+    } // preprocess
+
+    void preprocess(const cv::Mat &src, cv::Mat &dst, const DetectOptions &opts)
+    {
+        TraceSpan span("preprocess");
+
+        smooth(src, dst, opts);
+
+        cv::threshold(dst, dst, 0, 500, cv::THRESH_TRIANGLE);
+
+        erode_mask(dst, dst, opts.erode_size);
+    } // preprocess
+
+    void erode_mask(const cv::Mat &src, cv::Mat &dst, int size)
+    {
+        // cv::Mat() is the 3x3 default so only build a kernel for other sizes.
+        if (size == 3)
+        {
+            cv::morphologyEx(src, dst, cv::MORPH_ERODE, cv::Mat());
+        }
+        else if (size > 0)
+        {
+            cv::Mat kernel = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(size, size));
+            cv::morphologyEx(src, dst, cv::MORPH_ERODE, kernel);
+        }
+        else if (src.data != dst.data)
+        {
+            src.copyTo(dst);
+        }
+    } // erode_mask
+
+    bool valid_pipeline(const DetectOptions &opts)
+    {
+        return opts.scale > 0 && opts.scale <= 1.0 &&
+               (opts.blur_size <= 1 || opts.blur_size % 2 == 1) &&
+               opts.erode_size >= 0 &&
+               opts.epsilon > 0 &&
+               opts.max_cosine >= 0 && opts.max_cosine <= 1.0;
+    } // valid_pipeline
+
+    void smooth(const cv::Mat &src, cv::Mat &dst, const DetectOptions &opts)
+    {
+        // apply some filters to get started. Sources that were decoded straight
+        // to grayscale skip the conversion and the first filter reads them
+        // directly so they are not copied either.
+        cv::Mat gray = src;
+        if (src.channels() != 1)
+        {
+            cv::cvtColor(src, dst, cv::COLOR_BGR2GRAY);
+            gray = dst;
+        }
+
+        // shrink after the color conversion so only one channel is resampled.
+        if (opts.scale < 1.0)
+        {
+            cv::resize(gray, dst, cv::Size(), opts.scale, opts.scale, cv::INTER_AREA);
+            gray = dst;
+        }
+
+        if (opts.blur_size > 1)
+        {
+            cv::medianBlur(gray, dst, opts.blur_size);
+        }
+        else if (gray.data != dst.data)
+        {
+            gray.copyTo(dst);
+        }
+    } // smooth
+
     double angle(cv::Point pt1, cv::Point pt2, cv::Point pt0)
     {
         double dx1 = pt1.x - pt0.x;
@@ -130,40 +564,59 @@ namespace ImageDetector
         return (dx1 * dx2 + dy1 * dy2) / sqrt((dx1 * dx1 + dy1 * dy1) * (dx2 * dx2 + dy2 * dy2) + 1e-10);
     } // angle
 
-    void find_squares(cv::Mat &src, std::vector<std::vector<cv::Point>> &squares)
+    bool is_square(const std::vector<cv::Point> &contour, std::vector<cv::Point> &approx,
+                   double epsilon, double min_area, double max_cosine)
     {
+        cv::approxPolyDP(contour, approx, cv::arcLength(contour, true) * epsilon, true);
+
+        if (approx.size() == 4 &&
+            fabs(cv::contourArea(approx)) > min_area &&
+            cv::isContourConvex(approx))
+        {
+            double maxCosine = 0;
+
+            for (int j = 2; j < 5; j++)
+            {
+                double cosine = fabs(angle(approx[j % 4], approx[j - 2], approx[j - 1]));
+                maxCosine = MAX(maxCosine, cosine);
+            }
+
+            return maxCosine < max_cosine;
+        }
+
+        return false;
+    } // is_square
+
+    void find_squares(cv::Mat &src, std::vector<std::vector<cv::Point>> &squares,
+                      double epsilon, double min_area, double max_cosine, const std::atomic<bool> *cancel)
+    {
+        TraceSpan span("find_squares");
+
         squares.clear();
 
-        std::vector<std::vector<cv::Point>> contours;
+        // thread_local so findContours refills the previous call's vectors
+        // rather than allocating fresh ones for every image.
+        static thread_local std::vector<std::vector<cv::Point>> contours;
         cv::findContours(src, contours, cv::RETR_LIST, cv::CHAIN_APPROX_SIMPLE);
 
-        std::vector<cv::Point> approx;
+        static thread_local std::vector<cv::Point> approx;
 
         for (size_t i = 0; i < contours.size(); i++)
         {
-            cv::approxPolyDP(contours[i], approx, cv::arcLength(contours[i], true) * 0.02, true);
+            if (cancelled(cancel))
+            {
+                squares.clear();
+                return;
+            }
 
-            if (approx.size() == 4 &&
-                fabs(cv::contourArea(approx)) > 1000 &&
-                cv::isContourConvex(approx))
+            if (is_square(contours[i], approx, epsilon, min_area, max_cosine))
             {
-                double maxCosine = 0;
-
-                for (int j = 2; j < 5; j++)
-                {
-                    double cosine = fabs(angle(approx[j % 4], approx[j - 2], approx[j - 1]));
-                    maxCosine = MAX(maxCosine, cosine);
-                }
-
-                if (maxCosine < 0.3)
-                {
-                    squares.push_back(approx);
-                }
+                squares.push_back(approx);
             }
         }
     } // find_squares
 
-    void max_square_edges(std::vector<std::vector<cv::Point>> src, std::vector<std::vector<cv::Point>> &dst)
+    void max_square_edges(const std::vector<std::vector<cv::Point>> &src, std::vector<std::vector<cv::Point>> &dst)
     {
         dst.clear();
 
@@ -247,12 +700,17 @@ namespace ImageDetector
         return d_white < d_black;
     } // first_row_is_white
 
-    void largest_area(std::vector<std::vector<cv::Point>> squares, std::vector<cv::Point> &dst)
+    void largest_area(const std::vector<std::vector<cv::Point>> &squares, std::vector<cv::Point> &dst)
     {
         dst.clear();
 
+        if (squares.empty())
+        {
+            return;
+        }
+
         int l_area = 0;
-        std::vector<cv::Point> l_square = squares[0];
+        size_t l_square = 0;
 
         // loop over squares
         for (size_t i = 0; i < squares.size(); i++)
@@ -264,7 +722,7 @@ namespace ImageDetector
 
             if (i == 0)
             {
-                l_square = squares[i];
+                l_square = i;
                 l_area = area;
                 continue;
             }
@@ -272,11 +730,27 @@ namespace ImageDetector
             if (area > l_area)
             {
                 l_area = area;
-                l_square = squares[i];
+                l_square = i;
             }
         }
 
-        dst = l_square;
+        dst = squares[l_square];
     } // largest_area
 
+    cv::Rect search_region(cv::Size frame, const DetectOptions &opts)
+    {
+        cv::Rect whole = cv::Rect(0, 0, frame.width, frame.height);
+        cv::Rect region = opts.roi & whole;
+        return region.area() > 0 ? region : whole;
+    } // search_region
+
+    void offset_details(ImageDetails &id, cv::Rect region)
+    {
+        if (id.area() > 0)
+        {
+            id.x += region.x;
+            id.y += region.y;
+        }
+    } // offset_details
+
 } // namespace ImageDetector
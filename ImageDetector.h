@@ -1,13 +1,19 @@
-#include "opencv2/opencv.hpp"
+#ifndef IMAGE_DETECTOR_H
+#define IMAGE_DETECTOR_H
+
 #include "opencv2/core.hpp"
 #include "opencv2/imgproc.hpp"
 #include "opencv2/imgcodecs.hpp"
-#include "opencv2/highgui.hpp"
 
 #include <stdio.h>
 
+#include <atomic>
+
 namespace ImageDetector
 {
+    class EdgeIntegrals;
+    class RunMask;
+
     class ImageDetails
     {
     public:
@@ -22,10 +28,102 @@ namespace ImageDetector
         int w;
     };
 
+    class DetectOptions
+    {
+    public:
+        DetectOptions();
+
+        // back intermediate Mats with the recycling PoolAllocator.
+        bool pooled;
+
+        // let the pool back large buffers with transparent huge pages.
+        bool huge_pages;
+
+        // stop looking once a square covers more than dominant_fraction of the
+        // searched area, or once no remaining contour could produce a bigger
+        // one. The searched area is roi when one is set, not the whole frame.
+        bool early_exit;
+        double dominant_fraction;
+
+        // pipeline parameters, normally picked per image by a tuning profile.
+        // scale < 1 runs the filters and contours on a downscaled copy.
+        double scale;
+        int blur_size;
+        int erode_size;
+        double epsilon;
+
+        // largest |cos| allowed at a corner before a quad stops counting as square.
+        double max_cosine;
+
+        // smallest square worth reporting, in full resolution pixels.
+        double min_area;
+
+        // further limits on the reported square, 0 for none. aspect is width
+        // over height.
+        double max_area;
+        double min_aspect;
+        double max_aspect;
+
+        // search only this part of the source, empty for the whole frame.
+        // Results are still in source coordinates. See LayoutHint.
+        cv::Rect roi;
+
+        // threshold and erode into a RunMask and trace components on its runs
+        // instead of running findContours over a full 8-bit mask.
+        bool run_length;
+
+        // snap candidates to the strongest nearby image edges (searching
+        // refine_radius source pixels) and drop those scoring under
+        // min_edge_score, in gray levels of contrast along their sides.
+        bool edge_verify;
+        int refine_radius;
+        double min_edge_score;
+
+        // polled inside the contour and run loops, which stop and come back
+        // empty once it is set. NULL never cancels. See race_detect.
+        const std::atomic<bool> *cancel;
+    };
+
+    class DetectStats
+    {
+    public:
+        DetectStats();
+
+        // Mat buffers requested during the call and how many the pool recycled.
+        size_t allocations;
+        size_t pool_hits;
+
+        // page faults taken by the calling thread during the call.
+        long minor_faults;
+        long major_faults;
+
+        // set when early_exit skipped candidates or the second polarity.
+        bool early_exit;
+
+        // set when the square was found on the inverted mask.
+        bool inverted;
+    };
+
     /**
      * Same as Detect but returns a more structured response.
      */
     ImageDetector::ImageDetails detect_v2(cv::Mat src);
+    ImageDetector::ImageDetails detect_v2(cv::Mat src, const DetectOptions &opts, DetectStats &stats);
+
+    /**
+     * The part of detect_v2 after preprocess. Takes a mask that has already been
+     * filtered so callers can free the source image before contours are traced.
+     * edges, when given, are used to verify and refine candidates.
+     */
+    ImageDetector::ImageDetails detect_mask(cv::Mat &mask, const DetectOptions &opts, DetectStats &stats,
+                                            const EdgeIntegrals *edges = NULL);
+
+    /**
+     * detect_mask for a run length encoded mask from preprocess_runs. Squares
+     * come from connected components traced on the runs, see trace_runs.
+     */
+    ImageDetector::ImageDetails detect_runs(const RunMask &runs, const DetectOptions &opts, DetectStats &stats,
+                                            const EdgeIntegrals *edges = NULL);
 
     /**
      * Helper function to detect_v2
@@ -36,6 +134,35 @@ namespace ImageDetector
      * Returns a vector of points that represent the 4 verticies of the found square image.
      */
     std::vector<cv::Point> detect(cv::Mat src);
+    std::vector<cv::Point> detect(cv::Mat src, const DetectOptions &opts, DetectStats &stats);
+
+    /**
+     * Runs the grayscale, blur, threshold and erode filters over src. The color
+     * conversion writes straight into dst so src is never cloned; dst keeps
+     * whatever allocator it was given.
+     */
+    void preprocess(const cv::Mat &src, cv::Mat &dst);
+    void preprocess(const cv::Mat &src, cv::Mat &dst, const DetectOptions &opts);
+
+    /**
+     * Whether the pipeline parameters are ones the filters accept: scale in
+     * (0, 1], blur_size odd or at most 1, erode_size at least 0, epsilon
+     * above 0 and max_cosine in [0, 1]. medianBlur throws on an even size,
+     * and a scale above 1 would shrink every reported square.
+     */
+    bool valid_pipeline(const DetectOptions &opts);
+
+    /**
+     * The grayscale, downscale and blur half of preprocess, stopping before the
+     * mask is binarized.
+     */
+    void smooth(const cv::Mat &src, cv::Mat &dst, const DetectOptions &opts);
+
+    /**
+     * The erode at the end of preprocess, a size x size rectangle. Sizes below
+     * 1 leave the mask as is.
+     */
+    void erode_mask(const cv::Mat &src, cv::Mat &dst, int size);
 
     /**
      * Calculates the angle between points.
@@ -43,16 +170,28 @@ namespace ImageDetector
     double angle(cv::Point pt1, cv::Point pt2, cv::Point pt0);
 
     /**
-     * Finds all the squares in the src image.
+     * Checks that contour approximates to a convex quad of a useful size with
+     * near right angles. The approximation is left in approx. epsilon is the
+     * approxPolyDP tolerance as a fraction of the contour's perimeter and
+     * max_cosine bounds how far each corner may be from 90 degrees.
      */
-    void find_squares(cv::Mat &src, std::vector<std::vector<cv::Point>> &squares);
+    bool is_square(const std::vector<cv::Point> &contour, std::vector<cv::Point> &approx,
+                   double epsilon = 0.02, double min_area = 1000, double max_cosine = 0.3);
+
+    /**
+     * Finds all the squares in the src image. Returns no squares if cancel is
+     * set while the contours are checked.
+     */
+    void find_squares(cv::Mat &src, std::vector<std::vector<cv::Point>> &squares,
+                      double epsilon = 0.02, double min_area = 1000, double max_cosine = 0.3,
+                      const std::atomic<bool> *cancel = NULL);
 
     /**
      * Contour sometimes returns uneven rectangle due to rounded corners. This function
      * accounts for that and expands the rectangle to the max bounds of the src
      * vectors setting it to out.
      */
-    void max_square_edges(std::vector<std::vector<cv::Point>> src, std::vector<std::vector<cv::Point>> &dst);
+    void max_square_edges(const std::vector<std::vector<cv::Point>> &src, std::vector<std::vector<cv::Point>> &dst);
 
     /**
      * Returns the average int color value (0-255) across the row.
@@ -67,6 +206,37 @@ namespace ImageDetector
     /**
      * Finds the largest square by area
      */
-    void largest_area(std::vector<std::vector<cv::Point>> squares, std::vector<cv::Point> &dst);
+    void largest_area(const std::vector<std::vector<cv::Point>> &squares, std::vector<cv::Point> &dst);
+
+    /**
+     * Drops squares from max_square_edges, found on a mask shrunk by
+     * opts.scale, that break opts' max_area or aspect limits.
+     */
+    void drop_outside_limits(std::vector<std::vector<cv::Point>> &squares, const DetectOptions &opts);
+
+    /**
+     * Maps a square found on a mask shrunk by opts.scale back onto the source.
+     */
+    void restore_scale(std::vector<cv::Point> &sq, const DetectOptions &opts);
+
+    /**
+     * The ImageDetails for a square from max_square_edges, empty unless it has
+     * 4 corners.
+     */
+    ImageDetails details_from_square(const std::vector<cv::Point> &l_sq);
+
+    /**
+     * The part of a frame opts.roi selects, clipped to the frame. The whole
+     * frame when the roi is empty or misses it.
+     */
+    cv::Rect search_region(cv::Size frame, const DetectOptions &opts);
+
+    /**
+     * Moves a result found inside region back to frame coordinates. Empty
+     * results stay empty.
+     */
+    void offset_details(ImageDetails &id, cv::Rect region);
 
 } // namespace ImageDetector
+
+#endif // IMAGE_DETECTOR_H
@@ -0,0 +1,116 @@
+#include "ImageHeader.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace ImageDetector
+{
+    static int be16(const unsigned char *p)
+    {
+        return (p[0] << 8) | p[1];
+    } // be16
+
+    static int be32(const unsigned char *p)
+    {
+        return (int)(((unsigned)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]);
+    } // be32
+
+    static int le16(const unsigned char *p)
+    {
+        return p[0] | (p[1] << 8);
+    } // le16
+
+    static int le32(const unsigned char *p)
+    {
+        return (int)(p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24));
+    } // le32
+
+    static bool jpeg_size(FILE *f, cv::Size &size)
+    {
+        unsigned char buf[8];
+
+        // walk the marker segments until a start of frame turns up.
+        while (fread(buf, 1, 4, f) == 4)
+        {
+            if (buf[0] != 0xFF)
+            {
+                return false;
+            }
+
+            int marker = buf[1];
+            int length = be16(buf + 2);
+
+            bool sof = marker >= 0xC0 && marker <= 0xCF &&
+                       marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+            if (sof)
+            {
+                if (fread(buf, 1, 5, f) != 5)
+                {
+                    return false;
+                }
+                size.height = be16(buf + 1);
+                size.width = be16(buf + 3);
+                return true;
+            }
+
+            if (length < 2 || fseek(f, length - 2, SEEK_CUR) != 0)
+            {
+                return false;
+            }
+        }
+
+        return false;
+    } // jpeg_size
+
+    bool read_image_size(const std::string &path, cv::Size &size)
+    {
+        ImageFormat format;
+        return read_image_size(path, size, format);
+    } // read_image_size
+
+    bool read_image_size(const std::string &path, cv::Size &size, ImageFormat &format)
+    {
+        format = FORMAT_UNKNOWN;
+
+        FILE *f = fopen(path.c_str(), "rb");
+        if (f == NULL)
+        {
+            return false;
+        }
+
+        unsigned char head[26];
+        size_t n = fread(head, 1, sizeof(head), f);
+        bool found = false;
+
+        if (n >= 24 && memcmp(head, "\x89PNG\r\n\x1a\n", 8) == 0)
+        {
+            size.width = be32(head + 16);
+            size.height = be32(head + 20);
+            format = FORMAT_PNG;
+            found = true;
+        }
+        else if (n >= 10 && memcmp(head, "GIF8", 4) == 0)
+        {
+            size.width = le16(head + 6);
+            size.height = le16(head + 8);
+            format = FORMAT_GIF;
+            found = true;
+        }
+        else if (n >= 26 && memcmp(head, "BM", 2) == 0)
+        {
+            size.width = le32(head + 18);
+            size.height = abs(le32(head + 22));
+            format = FORMAT_BMP;
+            found = true;
+        }
+        else if (n >= 2 && head[0] == 0xFF && head[1] == 0xD8)
+        {
+            format = FORMAT_JPEG;
+            found = fseek(f, 2, SEEK_SET) == 0 && jpeg_size(f, size);
+        }
+
+        fclose(f);
+        return found && size.width > 0 && size.height > 0;
+    } // read_image_size
+
+} // namespace ImageDetector
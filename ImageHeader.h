@@ -0,0 +1,32 @@
+#ifndef IMAGE_DETECTOR_IMAGE_HEADER_H
+#define IMAGE_DETECTOR_IMAGE_HEADER_H
+
+#include "opencv2/core.hpp"
+
+#include <string>
+
+namespace ImageDetector
+{
+    enum ImageFormat
+    {
+        FORMAT_UNKNOWN,
+        FORMAT_PNG,
+        FORMAT_JPEG,
+        FORMAT_GIF,
+        FORMAT_BMP
+    };
+
+    /**
+     * Reads the pixel dimensions from a PNG, JPEG, GIF or BMP header without
+     * decoding the image. Returns false for anything else or a truncated file.
+     */
+    bool read_image_size(const std::string &path, cv::Size &size);
+
+    /**
+     * As above, also reporting which of those formats the file is.
+     */
+    bool read_image_size(const std::string &path, cv::Size &size, ImageFormat &format);
+
+} // namespace ImageDetector
+
+#endif // IMAGE_DETECTOR_IMAGE_HEADER_H
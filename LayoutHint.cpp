@@ -0,0 +1,238 @@
+#include "LayoutHint.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+namespace ImageDetector
+{
+    // sources need this many found images before a hint is trusted.
+    static const int HINT_MIN_SAMPLES = 5;
+
+    // share of samples at either end of each measure ignored as outliers.
+    static const double HINT_TRIM = 0.05;
+
+    // padding around the learned region, as a fraction of the frame.
+    static const double HINT_MARGIN = 0.05;
+
+    // how far the learned aspect and size ranges are widened either way.
+    static const double HINT_SLACK = 0.2;
+
+    LayoutHint::LayoutHint()
+    {
+        roi_x = 0;
+        roi_y = 0;
+        roi_w = 0;
+        roi_h = 0;
+        min_aspect = 0;
+        max_aspect = 0;
+        min_fraction = 0;
+        max_fraction = 0;
+        samples = 0;
+    }
+
+    std::string hint_source(const std::string &path)
+    {
+        size_t slash = path.find_last_of('/');
+        if (slash == std::string::npos || slash == 0)
+        {
+            return "";
+        }
+
+        size_t start = path.find_last_of('/', slash - 1);
+        start = start == std::string::npos ? 0 : start + 1;
+        return path.substr(start, slash - start);
+    } // hint_source
+
+    const LayoutHint *find_hint(const HintProfile &profile, const std::string &source)
+    {
+        for (size_t i = 0; i < profile.hints.size(); i++)
+        {
+            if (profile.hints[i].source == source)
+            {
+                return &profile.hints[i];
+            }
+        }
+        return NULL;
+    } // find_hint
+
+    void apply_hint(const LayoutHint &hint, cv::Size frame, DetectOptions &opts)
+    {
+        double frame_area = frame.width * (double)frame.height;
+
+        if (hint.roi_w > 0 && hint.roi_h > 0)
+        {
+            int x0 = cvFloor(hint.roi_x * frame.width);
+            int y0 = cvFloor(hint.roi_y * frame.height);
+            int x1 = cvCeil((hint.roi_x + hint.roi_w) * frame.width);
+            int y1 = cvCeil((hint.roi_y + hint.roi_h) * frame.height);
+            opts.roi = cv::Rect(x0, y0, x1 - x0, y1 - y0);
+        }
+
+        opts.min_aspect = hint.min_aspect;
+        opts.max_aspect = hint.max_aspect;
+        opts.min_area = MAX(opts.min_area, hint.min_fraction * frame_area);
+        opts.max_area = hint.max_fraction > 0 ? hint.max_fraction * frame_area : opts.max_area;
+    } // apply_hint
+
+    ImageDetails detect_hinted(cv::Mat src, const DetectOptions &opts, const LayoutHint &hint,
+                               DetectStats &stats, bool &hinted)
+    {
+        DetectOptions local = opts;
+        apply_hint(hint, src.size(), local);
+
+        ImageDetails id = detect_v2(src, local, stats);
+        hinted = id.area() > 0;
+        if (hinted)
+        {
+            return id;
+        }
+
+        return detect_v2(src, opts, stats);
+    } // detect_hinted
+
+    static double quantile(std::vector<double> &values, double q)
+    {
+        std::sort(values.begin(), values.end());
+        return values[(size_t)(q * (values.size() - 1) + 0.5)];
+    } // quantile
+
+    /**
+     * The measures learn_hints takes ranges over, one entry per found image.
+     */
+    class HintMeasures
+    {
+    public:
+        std::vector<double> left;
+        std::vector<double> top;
+        std::vector<double> right;
+        std::vector<double> bottom;
+        std::vector<double> aspect;
+        std::vector<double> fraction;
+    };
+
+    void learn_hints(const std::vector<HintSample> &samples, HintProfile &profile)
+    {
+        profile.hints.clear();
+
+        std::map<std::string, HintMeasures> sources;
+        for (size_t i = 0; i < samples.size(); i++)
+        {
+            ImageDetails d = samples[i].details;
+            double w = samples[i].frame.width;
+            double h = samples[i].frame.height;
+            if (d.area() <= 0 || w <= 0 || h <= 0)
+            {
+                continue;
+            }
+
+            HintMeasures &m = sources[samples[i].source];
+            m.left.push_back(d.x / w);
+            m.top.push_back(d.y / h);
+            m.right.push_back((d.x + d.w) / w);
+            m.bottom.push_back((d.y + d.h) / h);
+            m.aspect.push_back(d.w / (double)d.h);
+            m.fraction.push_back(d.area() / (w * h));
+        }
+
+        std::map<std::string, HintMeasures>::iterator it;
+        for (it = sources.begin(); it != sources.end(); ++it)
+        {
+            HintMeasures &m = it->second;
+            if ((int)m.left.size() < HINT_MIN_SAMPLES)
+            {
+                continue;
+            }
+
+            double left = MAX(0.0, quantile(m.left, HINT_TRIM) - HINT_MARGIN);
+            double top = MAX(0.0, quantile(m.top, HINT_TRIM) - HINT_MARGIN);
+            double right = MIN(1.0, quantile(m.right, 1 - HINT_TRIM) + HINT_MARGIN);
+            double bottom = MIN(1.0, quantile(m.bottom, 1 - HINT_TRIM) + HINT_MARGIN);
+
+            LayoutHint hint = LayoutHint();
+            hint.source = it->first;
+            hint.roi_x = left;
+            hint.roi_y = top;
+            hint.roi_w = right - left;
+            hint.roi_h = bottom - top;
+            hint.min_aspect = quantile(m.aspect, HINT_TRIM) / (1 + HINT_SLACK);
+            hint.max_aspect = quantile(m.aspect, 1 - HINT_TRIM) * (1 + HINT_SLACK);
+            hint.min_fraction = quantile(m.fraction, HINT_TRIM) / (1 + HINT_SLACK);
+            hint.max_fraction = MIN(1.0, quantile(m.fraction, 1 - HINT_TRIM) * (1 + HINT_SLACK));
+            hint.samples = (int)m.left.size();
+
+            profile.hints.push_back(hint);
+        }
+    } // learn_hints
+
+    bool load_hints(const std::string &path, HintProfile &profile)
+    {
+        profile.hints.clear();
+
+        std::ifstream in(path.c_str());
+        if (!in.is_open())
+        {
+            return false;
+        }
+
+        std::string line;
+        while (std::getline(in, line))
+        {
+            if (line.empty() || line[0] == '#')
+            {
+                continue;
+            }
+
+            std::istringstream fields(line);
+            LayoutHint hint = LayoutHint();
+            fields >> hint.roi_x >> hint.roi_y >> hint.roi_w >> hint.roi_h >> hint.min_aspect >> hint.max_aspect >> hint.min_fraction >> hint.max_fraction >> hint.samples;
+            if (fields.fail())
+            {
+                continue;
+            }
+
+            // the source is the rest of the line after one space, since a
+            // directory name can hold spaces and is empty for a bare file.
+            fields.get();
+            std::getline(fields, hint.source);
+            if (!hint.source.empty() && hint.source[hint.source.size() - 1] == '\r')
+            {
+                hint.source.resize(hint.source.size() - 1);
+            }
+
+            profile.hints.push_back(hint);
+        }
+
+        return true;
+    } // load_hints
+
+    bool save_hints(const std::string &path, const HintProfile &profile)
+    {
+        std::ofstream out(path.c_str());
+        if (!out.is_open())
+        {
+            return false;
+        }
+
+        out << "# roi_x roi_y roi_w roi_h min_aspect max_aspect min_fraction max_fraction samples source" << std::endl;
+        for (size_t i = 0; i < profile.hints.size(); i++)
+        {
+            const LayoutHint &hint = profile.hints[i];
+            out << hint.roi_x
+                << " " << hint.roi_y
+                << " " << hint.roi_w
+                << " " << hint.roi_h
+                << " " << hint.min_aspect
+                << " " << hint.max_aspect
+                << " " << hint.min_fraction
+                << " " << hint.max_fraction
+                << " " << hint.samples
+                << " " << hint.source
+                << std::endl;
+        }
+
+        return out.good();
+    } // save_hints
+
+} // namespace ImageDetector
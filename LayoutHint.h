@@ -0,0 +1,103 @@
+#ifndef IMAGE_DETECTOR_LAYOUT_HINT_H
+#define IMAGE_DETECTOR_LAYOUT_HINT_H
+
+#include "ImageDetector.h"
+
+#include <string>
+#include <vector>
+
+namespace ImageDetector
+{
+    /**
+     * Where one source (an app, say) puts its embedded image. Positions and
+     * sizes are fractions of the frame so one hint covers every resolution
+     * the source produces.
+     */
+    class LayoutHint
+    {
+    public:
+        LayoutHint();
+
+        std::string source;
+
+        // the band to search, empty (w or h of 0) for the whole frame.
+        double roi_x;
+        double roi_y;
+        double roi_w;
+        double roi_h;
+
+        // width over height and share of the frame's area the image may
+        // have, 0 for no limit.
+        double min_aspect;
+        double max_aspect;
+        double min_fraction;
+        double max_fraction;
+
+        // results the hint was learned from.
+        int samples;
+    };
+
+    class HintProfile
+    {
+    public:
+        std::vector<LayoutHint> hints;
+    };
+
+    /**
+     * A past result to learn from.
+     */
+    class HintSample
+    {
+    public:
+        std::string source;
+        cv::Size frame;
+        ImageDetails details;
+    };
+
+    /**
+     * The source a path belongs to: the name of the directory it is in, so
+     * screenshots filed per app pick up that app's hint.
+     */
+    std::string hint_source(const std::string &path);
+
+    /**
+     * The profile's hint for source, NULL if it has none.
+     */
+    const LayoutHint *find_hint(const HintProfile &profile, const std::string &source);
+
+    /**
+     * Turns the hint into a roi and size/aspect limits in frame pixels on top
+     * of whatever opts already holds. min_area is only ever raised.
+     */
+    void apply_hint(const LayoutHint &hint, cv::Size frame, DetectOptions &opts);
+
+    /**
+     * detect_v2 inside the hint's region and limits. When nothing there
+     * qualifies the whole frame is searched again without them. hinted says
+     * which of the two answered.
+     */
+    ImageDetails detect_hinted(cv::Mat src, const DetectOptions &opts, const LayoutHint &hint,
+                               DetectStats &stats, bool &hinted);
+
+    /**
+     * Builds a hint per source that found an image in enough samples. The
+     * region covers where the images were seen, less outliers, plus a margin;
+     * the aspect and size ranges are widened the same way.
+     */
+    void learn_hints(const std::vector<HintSample> &samples, HintProfile &profile);
+
+    /**
+     * Reads a profile written by save_hints. Returns false if the file could
+     * not be opened.
+     */
+    bool load_hints(const std::string &path, HintProfile &profile);
+
+    /**
+     * Writes the profile as one line per source: the numbers separated by
+     * spaces, then the source as the rest of the line.
+     */
+    bool save_hints(const std::string &path, const HintProfile &profile);
+
+} // namespace ImageDetector
+
+#endif // IMAGE_DETECTOR_LAYOUT_HINT_H
@@ -0,0 +1,336 @@
+#include "MatPool.h"
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include <atomic>
+#include <vector>
+
+namespace ImageDetector
+{
+    // buffers smaller than this share the first bucket.
+    static const size_t MIN_BUCKET_BYTES = 4096;
+
+    // transparent huge pages are 2MB on every platform we run on.
+    static const size_t HUGE_PAGE_BYTES = 2 * 1024 * 1024;
+
+    // per thread cap, and a cap over every thread's free lists together so
+    // many workers and race helpers can't park gigabytes between them.
+    static std::atomic<size_t> pool_limit(32 * 1024 * 1024);
+    static const size_t PROCESS_POOL_LIMIT = 256 * 1024 * 1024;
+    static std::atomic<size_t> process_cached(0);
+
+    /**
+     * Free lists for one thread. Index 0 holds malloc'd buffers and index 1
+     * holds mmap'd huge page buffers so each goes back the way it came.
+     */
+    class ThreadPool
+    {
+    public:
+        ThreadPool() : bytes_cached(0), allocations(0), pool_hits(0) {}
+
+        std::vector<std::vector<void *>> buckets[2];
+        size_t bytes_cached;
+        size_t allocations;
+        size_t pool_hits;
+    };
+
+    // plain pointer rather than a thread_local object so a Mat released during
+    // thread teardown never touches a pool that has already been destroyed.
+    static thread_local ThreadPool *thread_pool = NULL;
+    static thread_local bool thread_pool_dead = false;
+
+    static void free_buffer(void *p, size_t capacity, bool huge)
+    {
+        if (huge)
+        {
+            munmap(p, capacity);
+        }
+        else
+        {
+            cv::fastFree(p);
+        }
+    } // free_buffer
+
+    static size_t bucket_index(size_t size)
+    {
+        if (size <= MIN_BUCKET_BYTES)
+        {
+            return 0;
+        }
+
+        // octave is floor(log2(size - 1)) and the quarter within it is picked
+        // by the two bits under the leading one.
+        size_t n = size - 1;
+        int octave = 0;
+        while ((n >> octave) > 1)
+        {
+            octave++;
+        }
+
+        size_t quarter = (n >> (octave - 2)) & 3;
+        return (octave - 12) * 4 + quarter + 1;
+    } // bucket_index
+
+    static size_t bucket_capacity(size_t index, bool huge)
+    {
+        size_t capacity = MIN_BUCKET_BYTES;
+        if (index > 0)
+        {
+            int octave = (int)((index - 1) / 4) + 12;
+            size_t quarter = (index - 1) % 4;
+            capacity = ((size_t)1 << octave) + (quarter + 1) * ((size_t)1 << (octave - 2));
+        }
+
+        if (huge && capacity >= HUGE_PAGE_BYTES)
+        {
+            capacity = (capacity + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+        }
+
+        return capacity;
+    } // bucket_capacity
+
+    static bool use_huge_pages(size_t capacity, bool huge)
+    {
+        return huge && capacity >= HUGE_PAGE_BYTES;
+    } // use_huge_pages
+
+    static void drain(ThreadPool *pool)
+    {
+        for (int kind = 0; kind < 2; kind++)
+        {
+            for (size_t i = 0; i < pool->buckets[kind].size(); i++)
+            {
+                size_t capacity = bucket_capacity(i, kind == 1);
+                for (size_t j = 0; j < pool->buckets[kind][i].size(); j++)
+                {
+                    free_buffer(pool->buckets[kind][i][j], capacity, kind == 1);
+                }
+                pool->buckets[kind][i].clear();
+            }
+        }
+        process_cached -= pool->bytes_cached;
+        pool->bytes_cached = 0;
+    } // drain
+
+    class ThreadPoolReaper
+    {
+    public:
+        ~ThreadPoolReaper()
+        {
+            if (thread_pool != NULL)
+            {
+                drain(thread_pool);
+                delete thread_pool;
+                thread_pool = NULL;
+            }
+            thread_pool_dead = true;
+        }
+    };
+
+    static thread_local ThreadPoolReaper thread_pool_reaper;
+
+    static ThreadPool *current_pool()
+    {
+        if (thread_pool_dead)
+        {
+            return NULL;
+        }
+
+        if (thread_pool == NULL)
+        {
+            // touch the reaper so its destructor is registered for this thread.
+            (void)&thread_pool_reaper;
+            thread_pool = new ThreadPool();
+        }
+
+        return thread_pool;
+    } // current_pool
+
+    PoolStats::PoolStats()
+    {
+        allocations = 0;
+        pool_hits = 0;
+        bytes_cached = 0;
+        minor_faults = 0;
+        major_faults = 0;
+    }
+
+    PoolAllocator::PoolAllocator(bool huge_pages, bool recycle)
+    {
+        this->huge_pages = huge_pages;
+        this->recycle = recycle;
+    }
+
+    cv::UMatData *PoolAllocator::allocate(int dims, const int *sizes, int type, void *data0, size_t *step,
+                                          cv::AccessFlag, cv::UMatUsageFlags) const
+    {
+        // same step calculation as cv's StdMatAllocator.
+        size_t total = CV_ELEM_SIZE(type);
+        for (int i = dims - 1; i >= 0; i--)
+        {
+            if (step)
+            {
+                if (data0 && step[i] != CV_AUTOSTEP)
+                {
+                    total = step[i];
+                }
+                else
+                {
+                    step[i] = total;
+                }
+            }
+            total *= sizes[i];
+        }
+
+        cv::UMatData *u = new cv::UMatData(this);
+        u->size = total;
+
+        if (data0)
+        {
+            u->data = u->origdata = (uchar *)data0;
+            u->flags |= cv::UMatData::USER_ALLOCATED;
+            return u;
+        }
+
+        size_t index = bucket_index(total);
+        size_t capacity = bucket_capacity(index, huge_pages);
+        bool huge = use_huge_pages(capacity, huge_pages);
+        void *p = NULL;
+
+        ThreadPool *pool = current_pool();
+        if (pool != NULL)
+        {
+            pool->allocations++;
+
+            std::vector<std::vector<void *>> &kind = pool->buckets[huge ? 1 : 0];
+            if (recycle && index < kind.size() && !kind[index].empty())
+            {
+                p = kind[index].back();
+                kind[index].pop_back();
+                pool->bytes_cached -= capacity;
+                process_cached -= capacity;
+                pool->pool_hits++;
+            }
+        }
+
+        if (p == NULL && huge)
+        {
+            p = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED)
+            {
+                delete u;
+                CV_Error(cv::Error::StsNoMem, "failed to map huge page buffer");
+            }
+#ifdef MADV_HUGEPAGE
+            madvise(p, capacity, MADV_HUGEPAGE);
+#endif
+        }
+
+        if (p == NULL)
+        {
+            p = cv::fastMalloc(capacity);
+        }
+
+        u->data = u->origdata = (uchar *)p;
+        return u;
+    } // allocate
+
+    bool PoolAllocator::allocate(cv::UMatData *u, cv::AccessFlag, cv::UMatUsageFlags) const
+    {
+        return u != NULL;
+    } // allocate
+
+    void PoolAllocator::deallocate(cv::UMatData *u) const
+    {
+        if (u == NULL)
+        {
+            return;
+        }
+
+        CV_Assert(u->urefcount == 0);
+        CV_Assert(u->refcount == 0);
+
+        if (!(u->flags & cv::UMatData::USER_ALLOCATED))
+        {
+            size_t index = bucket_index(u->size);
+            size_t capacity = bucket_capacity(index, huge_pages);
+            bool huge = use_huge_pages(capacity, huge_pages);
+
+            ThreadPool *pool = current_pool();
+            if (recycle && pool != NULL && pool->bytes_cached + capacity <= pool_limit &&
+                process_cached + capacity <= PROCESS_POOL_LIMIT)
+            {
+                std::vector<std::vector<void *>> &kind = pool->buckets[huge ? 1 : 0];
+                if (kind.size() <= index)
+                {
+                    kind.resize(index + 1);
+                }
+                kind[index].push_back(u->origdata);
+                pool->bytes_cached += capacity;
+                process_cached += capacity;
+            }
+            else
+            {
+                free_buffer(u->origdata, capacity, huge);
+            }
+
+            u->origdata = 0;
+        }
+
+        delete u;
+    } // deallocate
+
+    cv::MatAllocator *pool_allocator(bool huge_pages, bool recycle)
+    {
+        static PoolAllocator allocators[4] = {
+            PoolAllocator(false, false),
+            PoolAllocator(false, true),
+            PoolAllocator(true, false),
+            PoolAllocator(true, true),
+        };
+        return &allocators[(huge_pages ? 2 : 0) + (recycle ? 1 : 0)];
+    } // pool_allocator
+
+    PoolStats pool_stats()
+    {
+        PoolStats stats = PoolStats();
+
+        ThreadPool *pool = current_pool();
+        if (pool != NULL)
+        {
+            stats.allocations = pool->allocations;
+            stats.pool_hits = pool->pool_hits;
+            stats.bytes_cached = pool->bytes_cached;
+        }
+
+        struct rusage usage;
+#ifdef RUSAGE_THREAD
+        int who = RUSAGE_THREAD;
+#else
+        int who = RUSAGE_SELF;
+#endif
+        if (getrusage(who, &usage) == 0)
+        {
+            stats.minor_faults = usage.ru_minflt;
+            stats.major_faults = usage.ru_majflt;
+        }
+
+        return stats;
+    } // pool_stats
+
+    size_t set_pool_limit(size_t bytes)
+    {
+        return pool_limit.exchange(bytes);
+    } // set_pool_limit
+
+    void release_pool()
+    {
+        ThreadPool *pool = current_pool();
+        if (pool != NULL)
+        {
+            drain(pool);
+        }
+    } // release_pool
+
+} // namespace ImageDetector
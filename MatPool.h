@@ -0,0 +1,73 @@
+#ifndef IMAGE_DETECTOR_MAT_POOL_H
+#define IMAGE_DETECTOR_MAT_POOL_H
+
+#include "opencv2/core.hpp"
+
+#include <stddef.h>
+
+namespace ImageDetector
+{
+    class PoolStats
+    {
+    public:
+        PoolStats();
+
+        size_t allocations;  // buffers handed out by the allocator
+        size_t pool_hits;    // of those, how many came from the free lists
+        size_t bytes_cached; // bytes currently parked in the free lists
+        long minor_faults;   // page faults taken by the calling thread
+        long major_faults;
+    };
+
+    /**
+     * cv::MatAllocator that recycles buffers through per-thread, size bucketed
+     * free lists instead of going back to malloc for every intermediate Mat.
+     *
+     * Buckets are a quarter of a power of two wide so a recycled buffer wastes
+     * at most 25% of its size. When huge_pages is set, buffers of 2MB and up are
+     * mmap'd and advised for transparent huge pages. With recycle turned off
+     * buffers are freed immediately and only the counters are kept, which gives
+     * a baseline to compare the pool against.
+     */
+    class PoolAllocator : public cv::MatAllocator
+    {
+    public:
+        PoolAllocator(bool huge_pages = false, bool recycle = true);
+
+        cv::UMatData *allocate(int dims, const int *sizes, int type, void *data, size_t *step,
+                               cv::AccessFlag flags, cv::UMatUsageFlags usage_flags) const;
+        bool allocate(cv::UMatData *data, cv::AccessFlag access_flags, cv::UMatUsageFlags usage_flags) const;
+        void deallocate(cv::UMatData *data) const;
+
+    private:
+        bool huge_pages;
+        bool recycle;
+    };
+
+    /**
+     * Returns the process wide pool allocator. Assign it to Mat::allocator
+     * before the Mat is first written to.
+     */
+    cv::MatAllocator *pool_allocator(bool huge_pages = false, bool recycle = true);
+
+    /**
+     * Returns the allocation and page fault counters for the calling thread.
+     */
+    PoolStats pool_stats();
+
+    /**
+     * Caps how many bytes each thread keeps in its free lists, 32MB unless
+     * set. All threads together keep at most 256MB either way. Buffers freed
+     * past a cap go straight back to the system. Returns the previous cap.
+     */
+    size_t set_pool_limit(size_t bytes);
+
+    /**
+     * Frees every buffer cached by the calling thread. Long lived threads call
+     * it when they go idle.
+     */
+    void release_pool();
+
+} // namespace ImageDetector
+
+#endif // IMAGE_DETECTOR_MAT_POOL_H
@@ -0,0 +1,16 @@
+#include "PathHash.h"
+
+namespace ImageDetector
+{
+    uint64_t path_hash(const char *path, size_t size)
+    {
+        uint64_t hash = 14695981039346656037ULL;
+        for (size_t i = 0; i < size; i++)
+        {
+            hash ^= (unsigned char)path[i];
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    } // path_hash
+
+} // namespace ImageDetector
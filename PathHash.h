@@ -0,0 +1,18 @@
+#ifndef IMAGE_DETECTOR_PATH_HASH_H
+#define IMAGE_DETECTOR_PATH_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace ImageDetector
+{
+    /**
+     * 64 bit FNV-1a of a path. Shard assignment and archive indexes are
+     * written by one build and read by another, possibly on another node,
+     * so this stays fixed where std::hash would not.
+     */
+    uint64_t path_hash(const char *path, size_t size);
+
+} // namespace ImageDetector
+
+#endif // IMAGE_DETECTOR_PATH_HASH_H
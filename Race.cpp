@@ -0,0 +1,440 @@
+#include "Race.h"
+#include "MatPool.h"
+#include "RunLength.h"
+#include "Trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace ImageDetector
+{
+    // how far inside and outside each side its contrast is sampled, in pixels.
+    static const int CONTRAST_OFFSET = 3;
+
+    // canny_detection's blur and thresholds.
+    static const int CANNY_BLUR = 9;
+    static const double CANNY_LOW = 100;
+    static const double CANNY_HIGH = 200;
+
+    // how long a race helper waits for work before freeing its Mat pool.
+    static const int IDLE_TRIM_MS = 1000;
+
+    RaceOptions::RaceOptions()
+    {
+        min_contrast = 16;
+    }
+
+    RaceResult::RaceResult()
+    {
+        contrast = 0;
+        confident = false;
+        inverted = false;
+    }
+
+    /**
+     * A strategy returns false if cancelled was set before it finished, and
+     * its dst is then meaningless. Besides checking between stages, opts.cancel
+     * points at cancelled so the contour and run loops stop part way too.
+     */
+    typedef bool (*Strategy)(const cv::Mat &gray, const DetectOptions &opts, const std::atomic<bool> &cancelled,
+                             ImageDetails &dst, bool &inverted);
+
+    static bool threshold_strategy(const cv::Mat &gray, const DetectOptions &opts,
+                                   const std::atomic<bool> &cancelled, ImageDetails &dst, bool &inverted)
+    {
+        cv::Mat mask;
+        mask.allocator = pool_allocator(opts.huge_pages, opts.pooled);
+        preprocess(gray, mask, opts);
+
+        if (cancelled)
+        {
+            return false;
+        }
+
+        DetectStats stats = DetectStats();
+        dst = detect_mask(mask, opts, stats);
+        inverted = stats.inverted;
+        return !cancelled;
+    } // threshold_strategy
+
+    static bool runs_strategy(const cv::Mat &gray, const DetectOptions &opts,
+                              const std::atomic<bool> &cancelled, ImageDetails &dst, bool &inverted)
+    {
+        RunMask runs = RunMask();
+        preprocess_runs(gray, runs, opts);
+
+        if (cancelled)
+        {
+            return false;
+        }
+
+        DetectStats stats = DetectStats();
+        dst = detect_runs(runs, opts, stats);
+        inverted = stats.inverted;
+        return !cancelled;
+    } // runs_strategy
+
+    static bool canny_strategy(const cv::Mat &gray, const DetectOptions &opts,
+                               const std::atomic<bool> &cancelled, ImageDetails &dst, bool &inverted)
+    {
+        cv::Mat edges;
+        edges.allocator = pool_allocator(opts.huge_pages, opts.pooled);
+        cv::GaussianBlur(gray, edges, cv::Size(CANNY_BLUR, CANNY_BLUR), 0);
+
+        if (cancelled)
+        {
+            return false;
+        }
+
+        cv::Canny(edges, edges, CANNY_LOW, CANNY_HIGH);
+
+        // close the gaps canny leaves at corners so the outlines trace as
+        // closed contours.
+        cv::dilate(edges, edges, cv::Mat());
+
+        if (cancelled)
+        {
+            return false;
+        }
+
+        std::vector<std::vector<cv::Point>> maybe_squares;
+        std::vector<std::vector<cv::Point>> squares;
+        find_squares(edges, maybe_squares, opts.epsilon, opts.min_area, opts.max_cosine, &cancelled);
+        max_square_edges(maybe_squares, squares);
+
+        // the same aspect and size limits the mask paths apply. Canny works on
+        // the unscaled gray image, so its squares are already in full
+        // resolution pixels.
+        DetectOptions unscaled = opts;
+        unscaled.scale = 1.0;
+        drop_outside_limits(squares, unscaled);
+
+        std::vector<cv::Point> l_sq;
+        largest_area(squares, l_sq);
+        dst = details_from_square(l_sq);
+        inverted = false;
+        return !cancelled;
+    } // canny_strategy
+
+    static const int STRATEGY_COUNT = 3;
+    static const char *strategy_names[STRATEGY_COUNT] = {"threshold", "runs", "canny"};
+    static const Strategy strategy_functions[STRATEGY_COUNT] = {threshold_strategy, runs_strategy, canny_strategy};
+
+    std::vector<std::string> race_strategies()
+    {
+        return std::vector<std::string>(strategy_names, strategy_names + STRATEGY_COUNT);
+    } // race_strategies
+
+    static double side_contrast(const cv::Mat &gray, cv::Rect inside, cv::Rect outside)
+    {
+        cv::Rect frame = cv::Rect(0, 0, gray.cols, gray.rows);
+        inside = inside & frame;
+        outside = outside & frame;
+        if (inside.area() == 0 || outside.area() == 0)
+        {
+            return -1;
+        }
+
+        return fabs(cv::mean(gray(inside))[0] - cv::mean(gray(outside))[0]);
+    } // side_contrast
+
+    static double rect_contrast(const cv::Mat &gray, const ImageDetails &d)
+    {
+        const int o = CONTRAST_OFFSET;
+        double sides[4] = {
+            side_contrast(gray, cv::Rect(d.x, d.y + o, d.w, 1), cv::Rect(d.x, d.y - o, d.w, 1)),
+            side_contrast(gray, cv::Rect(d.x, d.y + d.h - o, d.w, 1), cv::Rect(d.x, d.y + d.h + o, d.w, 1)),
+            side_contrast(gray, cv::Rect(d.x + o, d.y, 1, d.h), cv::Rect(d.x - o, d.y, 1, d.h)),
+            side_contrast(gray, cv::Rect(d.x + d.w - o, d.y, 1, d.h), cv::Rect(d.x + d.w + o, d.y, 1, d.h)),
+        };
+
+        // sides on the frame's edge have nothing outside to compare against.
+        double total = 0;
+        int measured = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            if (sides[i] >= 0)
+            {
+                total += sides[i];
+                measured++;
+            }
+        }
+
+        return measured > 0 ? total / measured : 0;
+    } // rect_contrast
+
+    /**
+     * Shared by one race_detect call and its strategies. Strategies hold it
+     * by shared_ptr since the losers can finish after the caller has left.
+     */
+    class RaceState
+    {
+    public:
+        RaceState() : cancelled(false), pending(0) {}
+
+        cv::Mat gray;
+        DetectOptions opts;
+        double min_contrast;
+
+        // RaceOptions::hold, let go with the last strategy.
+        std::shared_ptr<void> hold;
+
+        std::atomic<bool> cancelled;
+
+        std::mutex mutex;
+        std::condition_variable finished;
+        int pending;
+        RaceResult best;
+    };
+
+    /**
+     * One strategy of one race, waiting for a helper.
+     */
+    class RaceTask
+    {
+    public:
+        std::shared_ptr<RaceState> state;
+        int strategy;
+    };
+
+    /**
+     * Threads the strategies run on, shared by every race. stop_race_helpers
+     * joins them, so none is left inside OpenCV, the Mat pool or a trace
+     * buffer while the process exits.
+     */
+    class RacePool
+    {
+    public:
+        RacePool() : stopping(false) {}
+
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::deque<RaceTask> tasks;
+        std::vector<std::thread> helpers;
+        bool stopping;
+    };
+
+    static RacePool *race_pool()
+    {
+        static RacePool *pool = new RacePool();
+        return pool;
+    } // race_pool
+
+    static void drop_cancelled(RacePool *pool)
+    {
+        std::vector<RaceTask> dropped;
+        {
+            std::lock_guard<std::mutex> lock(pool->mutex);
+            size_t kept = 0;
+            for (size_t i = 0; i < pool->tasks.size(); i++)
+            {
+                if (pool->tasks[i].state->cancelled)
+                {
+                    dropped.push_back(pool->tasks[i]);
+                }
+                else
+                {
+                    pool->tasks[kept++] = pool->tasks[i];
+                }
+            }
+            pool->tasks.resize(kept);
+        }
+
+        // outside the pool's lock, since run_strategy takes a race's lock
+        // before the pool's.
+        for (size_t i = 0; i < dropped.size(); i++)
+        {
+            RaceState &state = *dropped[i].state;
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.pending--;
+            state.finished.notify_all();
+        }
+    } // drop_cancelled
+
+    static void run_strategy(std::shared_ptr<RaceState> state, int s)
+    {
+        ImageDetails found = ImageDetails();
+        bool inverted = false;
+        bool done = false;
+
+        // a helper may pick it up just before the race is decided.
+        if (!state->cancelled)
+        {
+            TraceSpan span(strategy_names[s]);
+            done = strategy_functions[s](state->gray, state->opts, state->cancelled, found, inverted);
+        }
+
+        double contrast = done && found.area() > 0 ? rect_contrast(state->gray, found) : 0;
+
+        bool decided = false;
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->pending--;
+
+            RaceResult &best = state->best;
+            if (done && found.area() > 0 && !best.confident && (best.winner.empty() || contrast > best.contrast))
+            {
+                best.details = found;
+                best.winner = strategy_names[s];
+                best.contrast = contrast;
+                best.inverted = inverted;
+                best.confident = contrast >= state->min_contrast;
+
+                if (best.confident)
+                {
+                    state->cancelled = true;
+                    decided = true;
+                }
+            }
+
+            state->finished.notify_all();
+        }
+
+        // the losers still queued would only hold up other images' races.
+        if (decided)
+        {
+            drop_cancelled(race_pool());
+        }
+    } // run_strategy
+
+    static void race_helper(RacePool *pool, int h)
+    {
+        trace_thread_name("racer " + std::to_string(h));
+
+        auto has_work = [pool]() { return !pool->tasks.empty() || pool->stopping; };
+        for (;;)
+        {
+            RaceTask task;
+            {
+                // one left idle hands its Mat pool back rather than holding
+                // it until the next race.
+                std::unique_lock<std::mutex> lock(pool->mutex);
+                if (!pool->ready.wait_for(lock, std::chrono::milliseconds(IDLE_TRIM_MS), has_work))
+                {
+                    lock.unlock();
+                    release_pool();
+                    lock.lock();
+                    pool->ready.wait(lock, has_work);
+                }
+
+                if (pool->tasks.empty())
+                {
+                    return;
+                }
+                task = pool->tasks.front();
+                pool->tasks.pop_front();
+            }
+            run_strategy(task.state, task.strategy);
+        }
+    } // race_helper
+
+    void start_race_helpers(int helpers)
+    {
+        RacePool *pool = race_pool();
+
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        for (int h = (int)pool->helpers.size(); h < helpers; h++)
+        {
+            pool->helpers.push_back(std::thread(race_helper, pool, h));
+        }
+    } // start_race_helpers
+
+    void stop_race_helpers()
+    {
+        RacePool *pool = race_pool();
+
+        std::vector<std::thread> helpers;
+        {
+            std::lock_guard<std::mutex> lock(pool->mutex);
+            for (size_t i = 0; i < pool->tasks.size(); i++)
+            {
+                pool->tasks[i].state->cancelled = true;
+            }
+            pool->stopping = true;
+            helpers.swap(pool->helpers);
+        }
+
+        drop_cancelled(pool);
+        pool->ready.notify_all();
+
+        // the strategies still running all lost a decided race, so they are
+        // cancelled already and stop at their next check.
+        for (size_t i = 0; i < helpers.size(); i++)
+        {
+            helpers[i].join();
+        }
+
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->stopping = false;
+    } // stop_race_helpers
+
+    static bool wanted(const RaceOptions &race, const char *name)
+    {
+        if (race.strategies.empty())
+        {
+            return true;
+        }
+
+        for (size_t i = 0; i < race.strategies.size(); i++)
+        {
+            if (race.strategies[i] == name)
+            {
+                return true;
+            }
+        }
+        return false;
+    } // wanted
+
+    void race_detect(const cv::Mat &src, const DetectOptions &opts, const RaceOptions &race, RaceResult &dst)
+    {
+        std::shared_ptr<RaceState> state = std::make_shared<RaceState>();
+        state->opts = opts;
+        state->opts.cancel = &state->cancelled;
+        state->min_contrast = race.min_contrast;
+        state->hold = race.hold;
+
+        // every strategy starts from gray, so convert once up front.
+        if (src.channels() != 1)
+        {
+            TraceSpan span("gray");
+            cv::cvtColor(src, state->gray, cv::COLOR_BGR2GRAY);
+        }
+        else
+        {
+            state->gray = src;
+        }
+
+        // enough for this race on its own when no batch started the helpers.
+        start_race_helpers(STRATEGY_COUNT);
+
+        RacePool *pool = race_pool();
+        {
+            std::lock_guard<std::mutex> lock(pool->mutex);
+            for (int s = 0; s < STRATEGY_COUNT; s++)
+            {
+                if (wanted(race, strategy_names[s]))
+                {
+                    RaceTask task;
+                    task.state = state;
+                    task.strategy = s;
+
+                    state->pending++;
+                    pool->tasks.push_back(task);
+                }
+            }
+        }
+        pool->ready.notify_all();
+
+        TraceSpan span("race");
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->finished.wait(lock, [&state]() { return state->pending == 0 || state->best.confident; });
+
+        dst = state->best;
+    } // race_detect
+
+} // namespace ImageDetector
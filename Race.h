@@ -0,0 +1,83 @@
+#ifndef IMAGE_DETECTOR_RACE_H
+#define IMAGE_DETECTOR_RACE_H
+
+#include "ImageDetector.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace ImageDetector
+{
+    class RaceOptions
+    {
+    public:
+        RaceOptions();
+
+        // names from race_strategies() to run, empty for all of them.
+        std::vector<std::string> strategies;
+
+        // contrast across the found rectangle's sides, in gray levels, that
+        // lets a result win before the other strategies finish.
+        double min_contrast;
+
+        // kept alive until every strategy has finished, which for the losers
+        // is after race_detect has returned. Callers tie whatever the losers
+        // still use, such as a memory budget charge, to its deleter.
+        std::shared_ptr<void> hold;
+    };
+
+    class RaceResult
+    {
+    public:
+        RaceResult();
+
+        ImageDetails details;
+
+        // the strategy whose answer was taken, empty if none found a square.
+        std::string winner;
+        double contrast;
+
+        // false when no strategy reached min_contrast and the best of all
+        // of them was taken once they had finished.
+        bool confident;
+
+        // set when the winner found the square on an inverted mask.
+        bool inverted;
+    };
+
+    /**
+     * The strategies race_detect knows: "threshold" is detect_v2's mask path,
+     * "runs" its run length path and "canny" traces squares on a dilated Canny
+     * edge map, as canny_detection in scratch.cpp does.
+     */
+    std::vector<std::string> race_strategies();
+
+    /**
+     * Grows the helper threads race_detect runs strategies on to at least
+     * helpers. They take the calling thread's affinity, so a batch starts
+     * them before pinning its workers. race_detect starts one per strategy
+     * itself if nothing has.
+     */
+    void start_race_helpers(int helpers);
+
+    /**
+     * Drops queued strategies and joins the helpers once the ones still
+     * running, all losers of decided races, have stopped. Call it when no
+     * race_detect is in progress and before exiting or writing a trace;
+     * run_batch does so itself. The next race starts them again.
+     */
+    void stop_race_helpers();
+
+    /**
+     * Runs the strategies concurrently on a shared grayscale copy of src and
+     * returns as soon as one finds a square with at least min_contrast. The
+     * rest are cancelled; those still queued are dropped, and running ones
+     * check between stages and inside the contour and run loops, stopping
+     * shortly after race_detect has returned.
+     */
+    void race_detect(const cv::Mat &src, const DetectOptions &opts, const RaceOptions &race, RaceResult &dst);
+
+} // namespace ImageDetector
+
+#endif // IMAGE_DETECTOR_RACE_H
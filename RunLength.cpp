@@ -0,0 +1,462 @@
+#include "RunLength.h"
+#include "MatPool.h"
+#include "Trace.h"
+
+namespace ImageDetector
+{
+    // share of a component's top and bottom rows that must be foreground
+    // before its row outline is trusted.
+    static const double EDGE_FILL = 0.5;
+
+    RunMask::RunMask()
+    {
+        rows = 0;
+        cols = 0;
+    }
+
+    static void push_run(std::vector<Run> &runs, int start, int end)
+    {
+        Run run;
+        run.start = start;
+        run.end = end;
+        runs.push_back(run);
+    } // push_run
+
+    static void begin_mask(RunMask &dst, int rows, int cols)
+    {
+        dst.rows = rows;
+        dst.cols = cols;
+        dst.runs.clear();
+        dst.row_offsets.clear();
+        dst.row_offsets.reserve(rows + 1);
+    } // begin_mask
+
+    void encode_runs(const cv::Mat &src, int thresh, RunMask &dst)
+    {
+        begin_mask(dst, src.rows, src.cols);
+
+        for (int y = 0; y < src.rows; y++)
+        {
+            dst.row_offsets.push_back((int)dst.runs.size());
+
+            const uchar *row = src.ptr<uchar>(y);
+            int x = 0;
+            while (x < src.cols)
+            {
+                while (x < src.cols && row[x] <= thresh)
+                    x++;
+
+                int start = x;
+                while (x < src.cols && row[x] > thresh)
+                    x++;
+
+                if (x > start)
+                {
+                    push_run(dst.runs, start, x);
+                }
+            }
+        }
+
+        dst.row_offsets.push_back((int)dst.runs.size());
+    } // encode_runs
+
+    void invert_runs(const RunMask &src, RunMask &dst)
+    {
+        begin_mask(dst, src.rows, src.cols);
+
+        for (int y = 0; y < src.rows; y++)
+        {
+            dst.row_offsets.push_back((int)dst.runs.size());
+
+            int prev = 0;
+            for (int k = src.row_offsets[y]; k < src.row_offsets[y + 1]; k++)
+            {
+                if (src.runs[k].start > prev)
+                {
+                    push_run(dst.runs, prev, src.runs[k].start);
+                }
+                prev = src.runs[k].end;
+            }
+
+            if (prev < src.cols)
+            {
+                push_run(dst.runs, prev, src.cols);
+            }
+        }
+
+        dst.row_offsets.push_back((int)dst.runs.size());
+    } // invert_runs
+
+    static void intersect_runs(const std::vector<Run> &a, const Run *b, int nb, std::vector<Run> &out)
+    {
+        out.clear();
+
+        size_t i = 0;
+        int j = 0;
+        while (i < a.size() && j < nb)
+        {
+            int start = MAX(a[i].start, b[j].start);
+            int end = MIN(a[i].end, b[j].end);
+            if (start < end)
+            {
+                push_run(out, start, end);
+            }
+
+            if (a[i].end < b[j].end)
+                i++;
+            else
+                j++;
+        }
+    } // intersect_runs
+
+    void erode_runs(const RunMask &src, RunMask &dst, int size)
+    {
+        if (size <= 1)
+        {
+            dst = src;
+            return;
+        }
+
+        // the kernel reaches before pixels on the left/top and after pixels on
+        // the right/bottom, matching cv's centered anchor.
+        int before = size / 2;
+        int after = size - 1 - before;
+
+        // erode each row horizontally first. Pixels past the image edge count
+        // as foreground like cv's default erode border, so runs touching the
+        // edge don't shrink on that side.
+        RunMask horizontal = RunMask();
+        begin_mask(horizontal, src.rows, src.cols);
+        for (int y = 0; y < src.rows; y++)
+        {
+            horizontal.row_offsets.push_back((int)horizontal.runs.size());
+            for (int k = src.row_offsets[y]; k < src.row_offsets[y + 1]; k++)
+            {
+                int start = src.runs[k].start == 0 ? 0 : src.runs[k].start + before;
+                int end = src.runs[k].end == src.cols ? src.cols : src.runs[k].end - after;
+                if (start < end)
+                {
+                    push_run(horizontal.runs, start, end);
+                }
+            }
+        }
+        horizontal.row_offsets.push_back((int)horizontal.runs.size());
+
+        // then vertically: a pixel survives if it is set in every row the
+        // kernel covers.
+        begin_mask(dst, src.rows, src.cols);
+
+        std::vector<Run> current;
+        std::vector<Run> next;
+        for (int y = 0; y < src.rows; y++)
+        {
+            dst.row_offsets.push_back((int)dst.runs.size());
+
+            int first = horizontal.row_offsets[y];
+            current.assign(horizontal.runs.begin() + first, horizontal.runs.begin() + horizontal.row_offsets[y + 1]);
+
+            for (int r = MAX(0, y - before); r <= MIN(src.rows - 1, y + after) && !current.empty(); r++)
+            {
+                if (r == y)
+                {
+                    continue;
+                }
+
+                int offset = horizontal.row_offsets[r];
+                int count = horizontal.row_offsets[r + 1] - offset;
+                const Run *row = count > 0 ? &horizontal.runs[offset] : NULL;
+                intersect_runs(current, row, count, next);
+                current.swap(next);
+            }
+
+            dst.runs.insert(dst.runs.end(), current.begin(), current.end());
+        }
+        dst.row_offsets.push_back((int)dst.runs.size());
+    } // erode_runs
+
+    int triangle_threshold(const cv::Mat &src)
+    {
+        // same steps as cv's getThreshVal_Triangle_8u so the runs match what
+        // cv::threshold would have produced.
+        const int N = 256;
+        int h[N] = {0};
+
+        for (int y = 0; y < src.rows; y++)
+        {
+            const uchar *row = src.ptr<uchar>(y);
+            for (int x = 0; x < src.cols; x++)
+            {
+                h[row[x]]++;
+            }
+        }
+
+        int left_bound = 0;
+        int right_bound = 0;
+        int max_ind = 0;
+        int max = 0;
+        bool flipped = false;
+
+        for (int i = 0; i < N; i++)
+        {
+            if (h[i] > 0)
+            {
+                left_bound = i;
+                break;
+            }
+        }
+        if (left_bound > 0)
+            left_bound--;
+
+        for (int i = N - 1; i > 0; i--)
+        {
+            if (h[i] > 0)
+            {
+                right_bound = i;
+                break;
+            }
+        }
+        if (right_bound < N - 1)
+            right_bound++;
+
+        for (int i = 0; i < N; i++)
+        {
+            if (h[i] > max)
+            {
+                max = h[i];
+                max_ind = i;
+            }
+        }
+
+        if (max_ind - left_bound < right_bound - max_ind)
+        {
+            flipped = true;
+            for (int i = 0, j = N - 1; i < j; i++, j--)
+            {
+                int temp = h[i];
+                h[i] = h[j];
+                h[j] = temp;
+            }
+            left_bound = N - 1 - right_bound;
+            max_ind = N - 1 - max_ind;
+        }
+
+        int thresh = left_bound;
+        double a = max;
+        double b = left_bound - max_ind;
+        double dist = 0;
+        for (int i = left_bound + 1; i <= max_ind; i++)
+        {
+            double tempdist = a * i + b * h[i];
+            if (tempdist > dist)
+            {
+                dist = tempdist;
+                thresh = i;
+            }
+        }
+        thresh--;
+
+        if (flipped)
+        {
+            thresh = N - 1 - thresh;
+        }
+
+        return thresh;
+    } // triangle_threshold
+
+    void preprocess_runs(const cv::Mat &src, RunMask &dst, const DetectOptions &opts)
+    {
+        TraceSpan span("preprocess");
+
+        cv::Mat gray;
+        gray.allocator = pool_allocator(opts.huge_pages, opts.pooled);
+        smooth(src, gray, opts);
+
+        RunMask thresholded = RunMask();
+        encode_runs(gray, triangle_threshold(gray), thresholded);
+        gray.release();
+
+        erode_runs(thresholded, dst, opts.erode_size);
+    } // preprocess_runs
+
+    /**
+     * Per component row profile built while walking the runs top to bottom.
+     * Connected components cover every row between their first and last.
+     */
+    class Component
+    {
+    public:
+        int top;
+        std::vector<int> left;
+        std::vector<int> right;
+        std::vector<int> fill;
+    };
+
+    static int find_root(std::vector<int> &parent, int i)
+    {
+        while (parent[i] != i)
+        {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    } // find_root
+
+    static void outline(const Component &c, std::vector<cv::Point> &contour)
+    {
+        contour.clear();
+
+        // down the left edge then up the right, only keeping the ends of each
+        // vertical stretch like CHAIN_APPROX_SIMPLE.
+        int h = (int)c.left.size();
+        for (int i = 0; i < h; i++)
+        {
+            if (i == 0 || i == h - 1 || c.left[i] != c.left[i - 1] || c.left[i] != c.left[i + 1])
+            {
+                contour.push_back(cv::Point(c.left[i], c.top + i));
+            }
+        }
+
+        for (int i = h - 1; i >= 0; i--)
+        {
+            if (i == 0 || i == h - 1 || c.right[i] != c.right[i - 1] || c.right[i] != c.right[i + 1])
+            {
+                contour.push_back(cv::Point(c.right[i] - 1, c.top + i));
+            }
+        }
+    } // outline
+
+    void trace_runs(const RunMask &src, std::vector<std::vector<cv::Point>> &contours, double min_area,
+                    const std::atomic<bool> *cancel)
+    {
+        contours.clear();
+
+        int n = (int)src.runs.size();
+        std::vector<int> parent(n);
+        for (int i = 0; i < n; i++)
+        {
+            parent[i] = i;
+        }
+
+        // join runs that touch a run in the row above, diagonals included.
+        for (int y = 1; y < src.rows; y++)
+        {
+            if (cancel != NULL && cancel->load(std::memory_order_relaxed))
+            {
+                return;
+            }
+
+            int i = src.row_offsets[y - 1];
+            int j = src.row_offsets[y];
+            while (i < src.row_offsets[y] && j < src.row_offsets[y + 1])
+            {
+                if (src.runs[i].end < src.runs[j].start)
+                {
+                    i++;
+                }
+                else if (src.runs[j].end < src.runs[i].start)
+                {
+                    j++;
+                }
+                else
+                {
+                    int a = find_root(parent, i);
+                    int b = find_root(parent, j);
+                    parent[MAX(a, b)] = MIN(a, b);
+
+                    if (src.runs[i].end < src.runs[j].end)
+                        i++;
+                    else
+                        j++;
+                }
+            }
+        }
+
+        std::vector<int> index(n, -1);
+        std::vector<Component> components;
+        for (int y = 0; y < src.rows; y++)
+        {
+            for (int k = src.row_offsets[y]; k < src.row_offsets[y + 1]; k++)
+            {
+                int root = find_root(parent, k);
+                if (index[root] < 0)
+                {
+                    index[root] = (int)components.size();
+                    components.push_back(Component());
+                    components.back().top = y;
+                }
+
+                Component &c = components[index[root]];
+                const Run &run = src.runs[k];
+                if (y - c.top == (int)c.left.size())
+                {
+                    c.left.push_back(run.start);
+                    c.right.push_back(run.end);
+                    c.fill.push_back(run.end - run.start);
+                }
+                else
+                {
+                    c.left.back() = MIN(c.left.back(), run.start);
+                    c.right.back() = MAX(c.right.back(), run.end);
+                    c.fill.back() += run.end - run.start;
+                }
+            }
+        }
+
+        std::vector<cv::Point> contour;
+        for (size_t i = 0; i < components.size(); i++)
+        {
+            const Component &c = components[i];
+            int h = (int)c.left.size();
+
+            int min_x = INT_MAX;
+            int max_x = INT_MIN;
+            for (int r = 0; r < h; r++)
+            {
+                min_x = MIN(min_x, c.left[r]);
+                max_x = MAX(max_x, c.right[r]);
+            }
+
+            if ((max_x - min_x) * (double)h <= min_area)
+            {
+                continue;
+            }
+
+            if (c.fill[0] < EDGE_FILL * (c.right[0] - c.left[0]) ||
+                c.fill[h - 1] < EDGE_FILL * (c.right[h - 1] - c.left[h - 1]))
+            {
+                continue;
+            }
+
+            outline(c, contour);
+            contours.push_back(contour);
+        }
+    } // trace_runs
+
+    void find_squares_runs(const RunMask &src, std::vector<std::vector<cv::Point>> &squares,
+                           double epsilon, double min_area, double max_cosine, const std::atomic<bool> *cancel)
+    {
+        TraceSpan span("find_squares");
+
+        squares.clear();
+
+        static thread_local std::vector<std::vector<cv::Point>> contours;
+        trace_runs(src, contours, min_area, cancel);
+
+        static thread_local std::vector<cv::Point> approx;
+
+        for (size_t i = 0; i < contours.size(); i++)
+        {
+            if (cancel != NULL && cancel->load(std::memory_order_relaxed))
+            {
+                squares.clear();
+                return;
+            }
+
+            if (is_square(contours[i], approx, epsilon, min_area, max_cosine))
+            {
+                squares.push_back(approx);
+            }
+        }
+    } // find_squares_runs
+
+} // namespace ImageDetector
@@ -0,0 +1,83 @@
+#ifndef IMAGE_DETECTOR_RUN_LENGTH_H
+#define IMAGE_DETECTOR_RUN_LENGTH_H
+
+#include "ImageDetector.h"
+
+#include <vector>
+
+namespace ImageDetector
+{
+    /**
+     * A horizontal stretch of foreground pixels, start inclusive and end
+     * exclusive.
+     */
+    class Run
+    {
+    public:
+        int start;
+        int end;
+    };
+
+    /**
+     * Binary mask stored as foreground runs. The runs for row y are
+     * runs[row_offsets[y]] up to runs[row_offsets[y + 1]], sorted by start.
+     */
+    class RunMask
+    {
+    public:
+        RunMask();
+
+        int rows;
+        int cols;
+        std::vector<Run> runs;
+        std::vector<int> row_offsets;
+    };
+
+    /**
+     * Encodes every pixel of src above thresh as foreground.
+     */
+    void encode_runs(const cv::Mat &src, int thresh, RunMask &dst);
+
+    /**
+     * Swaps foreground and background.
+     */
+    void invert_runs(const RunMask &src, RunMask &dst);
+
+    /**
+     * Same as MORPH_ERODE with a size x size rectangle and cv's default border,
+     * done on the runs directly.
+     */
+    void erode_runs(const RunMask &src, RunMask &dst, int size);
+
+    /**
+     * The threshold cv::THRESH_TRIANGLE would pick for src.
+     */
+    int triangle_threshold(const cv::Mat &src);
+
+    /**
+     * preprocess, but the mask comes out run length encoded. The blurred gray
+     * image is the only full frame buffer; thresholding happens while the runs
+     * are encoded and the erode happens on the runs.
+     */
+    void preprocess_runs(const cv::Mat &src, RunMask &dst, const DetectOptions &opts);
+
+    /**
+     * Labels the 8-connected components of src and returns an outline for each
+     * one bigger than min_area. The outline follows the leftmost and rightmost
+     * pixel of every row, so holes are ignored and only components whose top
+     * and bottom rows are mostly filled are kept; a notch in those edges would
+     * otherwise be hidden. Returns no outlines if cancel is set part way.
+     */
+    void trace_runs(const RunMask &src, std::vector<std::vector<cv::Point>> &contours, double min_area = 1000,
+                    const std::atomic<bool> *cancel = NULL);
+
+    /**
+     * find_squares for a RunMask.
+     */
+    void find_squares_runs(const RunMask &src, std::vector<std::vector<cv::Point>> &squares,
+                           double epsilon = 0.02, double min_area = 1000, double max_cosine = 0.3,
+                           const std::atomic<bool> *cancel = NULL);
+
+} // namespace ImageDetector
+
+#endif // IMAGE_DETECTOR_RUN_LENGTH_H
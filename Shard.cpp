@@ -0,0 +1,295 @@
+#include "Shard.h"
+#include "PathHash.h"
+#include "Trace.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <set>
+
+namespace ImageDetector
+{
+    // results held between writes and fdatasync calls. This bounds what a
+    // kill or crash makes a resumed shard redo.
+    static const size_t SYNC_EVERY = 64;
+
+    ShardOptions::ShardOptions()
+    {
+        index = 0;
+        count = 1;
+        dir = ".";
+    }
+
+    ShardProgress::ShardProgress()
+    {
+        assigned = 0;
+        resumed = 0;
+        processed = 0;
+        retried = 0;
+        crops_failed = 0;
+    }
+
+    bool load_manifest(const std::string &path, std::vector<std::string> &paths)
+    {
+        paths.clear();
+
+        std::ifstream in(path.c_str());
+        if (!in.is_open())
+        {
+            return false;
+        }
+
+        std::string line;
+        std::set<std::string> seen;
+        while (std::getline(in, line))
+        {
+            if (!line.empty() && line[line.size() - 1] == '\r')
+            {
+                line.resize(line.size() - 1);
+            }
+
+            // a repeated path would be written twice by merge_shards.
+            if (!line.empty() && seen.insert(line).second)
+            {
+                paths.push_back(line);
+            }
+        }
+
+        return true;
+    } // load_manifest
+
+    int shard_of(const std::string &path, int count)
+    {
+        return (int)(path_hash(path.data(), path.size()) % (uint64_t)MAX(count, 1));
+    } // shard_of
+
+    std::string shard_file(const std::string &dir, int index, int count)
+    {
+        return dir + "/shard-" + std::to_string(index) + "-of-" + std::to_string(count) + ".ndjson";
+    } // shard_file
+
+    /**
+     * Calls found with the result and text of every complete line in a shard
+     * file. Returns how many bytes those lines cover; anything after is a
+     * line torn by a kill.
+     */
+    template <typename Found>
+    static size_t read_shard(const std::string &file, Found found)
+    {
+        std::ifstream in(file.c_str(), std::ios::binary);
+
+        size_t valid = 0;
+        std::string line;
+        BatchResult r;
+        while (std::getline(in, line) && !in.eof())
+        {
+            valid += line.size() + 1;
+            if (parse_result_json(line, r))
+            {
+                found(r, line);
+            }
+        }
+
+        return valid;
+    } // read_shard
+
+    bool run_shard(const std::vector<std::string> &manifest, const ShardOptions &opts, ShardProgress &progress)
+    {
+        progress = ShardProgress();
+
+        std::string file = shard_file(opts.dir, opts.index, opts.count);
+        int fd = open(file.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        // one writer per shard, a second process on it would interleave.
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+        {
+            close(fd);
+            return false;
+        }
+
+        // a rerun of this shard continues the writer's sequence, and nothing
+        // else can be writing under its name while the lock is held. That
+        // also makes it safe to index what a killed run left behind, whose
+        // crops are already checkpointed and would otherwise stay invisible
+        // to readers.
+        ArchiveWriter archive;
+        BatchOptions batch = opts.batch;
+        if (!opts.archive_dir.empty())
+        {
+            std::string name = "crops-" + std::to_string(opts.index) + "-of-" + std::to_string(opts.count);
+            if (repair_archive(opts.archive_dir, name) < 0 || !archive.open(opts.archive_dir, name))
+            {
+                close(fd);
+                return false;
+            }
+            batch.archive = &archive;
+        }
+
+        // an unreadable result may be a passing fault on shared storage, so
+        // its path runs again and the new line is appended after the old one.
+        std::set<std::string> done;
+        std::set<std::string> unreadable;
+        size_t valid = read_shard(file, [&done, &unreadable](const BatchResult &r, const std::string &) {
+            if (r.ok)
+            {
+                done.insert(r.path);
+            }
+            else
+            {
+                unreadable.insert(r.path);
+            }
+        });
+
+        if (ftruncate(fd, (off_t)valid) != 0)
+        {
+            close(fd);
+            return false;
+        }
+
+        std::vector<std::string> todo;
+        std::set<std::string> queued;
+        for (size_t i = 0; i < manifest.size(); i++)
+        {
+            if (shard_of(manifest[i], opts.count) != opts.index || !queued.insert(manifest[i]).second)
+            {
+                continue;
+            }
+
+            progress.assigned++;
+            if (done.count(manifest[i]) > 0)
+            {
+                progress.resumed++;
+            }
+            else
+            {
+                todo.push_back(manifest[i]);
+                progress.retried += unreadable.count(manifest[i]);
+            }
+        }
+
+        // with an archive, lines wait until their crops are on disk. Otherwise
+        // a kill could leave a path checkpointed whose crop was still
+        // buffered, and the resume would never archive it.
+        bool ok = true;
+        std::vector<std::string> pending;
+        size_t unsynced = 0;
+        auto write_pending = [&](bool last) {
+            if (batch.archive != NULL && !last && pending.size() < SYNC_EVERY)
+            {
+                return;
+            }
+
+            TraceSpan span("write");
+            if (batch.archive != NULL && !batch.archive->sync())
+            {
+                ok = false;
+            }
+
+            for (size_t i = 0; ok && i < pending.size(); i++)
+            {
+                // one write per line so a kill can only tear the last one.
+                if (write(fd, pending[i].data(), pending[i].size()) != (ssize_t)pending[i].size())
+                {
+                    ok = false;
+                }
+            }
+            unsynced += pending.size();
+            pending.clear();
+
+            if (last || unsynced >= SYNC_EVERY)
+            {
+                if (fdatasync(fd) != 0)
+                {
+                    ok = false;
+                }
+                unsynced = 0;
+            }
+        };
+
+        // a failed write ends the shard, since nothing processed after it
+        // could be checkpointed. A rerun picks up from the last good line.
+        std::atomic<bool> failed(false);
+        batch.stop = &failed;
+
+        run_batch(todo, batch, [&](const BatchResult &r) {
+            if (!ok)
+            {
+                return;
+            }
+
+            pending.push_back(result_json(r) + "\n");
+            progress.processed++;
+            progress.crops_failed += r.crop == "failed" ? 1 : 0;
+            write_pending(false);
+
+            if (!ok)
+            {
+                failed = true;
+            }
+        });
+
+        write_pending(true);
+
+        if (batch.archive != NULL && !archive.close())
+        {
+            ok = false;
+        }
+
+        close(fd);
+        return ok;
+    } // run_shard
+
+    bool merge_shards(const std::vector<std::string> &manifest, const std::string &dir, int count,
+                      const std::string &out, size_t &missing)
+    {
+        missing = 0;
+
+        std::map<std::string, std::string> lines;
+        for (int i = 0; i < count; i++)
+        {
+            // a retried path's later line replaces its unreadable one.
+            read_shard(shard_file(dir, i, count), [&lines](const BatchResult &r, const std::string &line) {
+                lines[r.path] = line;
+            });
+        }
+
+        // written aside and renamed so readers never see half a merge.
+        std::string tmp = out + ".tmp";
+        {
+            std::ofstream merged(tmp.c_str(), std::ios::binary);
+            if (!merged.is_open())
+            {
+                return false;
+            }
+
+            for (size_t i = 0; i < manifest.size(); i++)
+            {
+                std::map<std::string, std::string>::const_iterator it = lines.find(manifest[i]);
+                if (it == lines.end())
+                {
+                    missing++;
+                    continue;
+                }
+                merged << it->second << "\n";
+            }
+
+            merged.flush();
+            if (!merged.good())
+            {
+                return false;
+            }
+        }
+
+        return rename(tmp.c_str(), out.c_str()) == 0;
+    } // merge_shards
+
+} // namespace ImageDetector
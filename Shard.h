@@ -0,0 +1,88 @@
+#ifndef IMAGE_DETECTOR_SHARD_H
+#define IMAGE_DETECTOR_SHARD_H
+
+#include "Batch.h"
+
+#include <string>
+#include <vector>
+
+namespace ImageDetector
+{
+    class ShardOptions
+    {
+    public:
+        ShardOptions();
+
+        // this process's shard, index in [0, count).
+        int index;
+        int count;
+
+        // directory the shard outputs live in, shared by every process.
+        std::string dir;
+
+        // crop archive directory, empty for none. The shard appends to it as
+        // crops-<index>-of-<count>, opened once the shard's lock is held.
+        std::string archive_dir;
+
+        BatchOptions batch;
+    };
+
+    class ShardProgress
+    {
+    public:
+        ShardProgress();
+
+        // manifest entries in this shard, those already in its output from
+        // an earlier run, and those processed now. retried counts the
+        // processed ones an earlier run could not read.
+        size_t assigned;
+        size_t resumed;
+        size_t processed;
+        size_t retried;
+
+        // crops that could not be encoded or written to the archive.
+        size_t crops_failed;
+    };
+
+    /**
+     * Reads one path per line, skipping blank lines and repeats of a path
+     * already read.
+     */
+    bool load_manifest(const std::string &path, std::vector<std::string> &paths);
+
+    /**
+     * The shard a path belongs to. Hashes the path itself, so every process
+     * agrees no matter how its manifest is ordered.
+     */
+    int shard_of(const std::string &path, int count);
+
+    /**
+     * The output file for one shard: <dir>/shard-<index>-of-<count>.ndjson.
+     */
+    std::string shard_file(const std::string &dir, int index, int count);
+
+    /**
+     * Runs run_batch over this shard's part of the manifest, appending one
+     * result_json line per image to its shard file. The file doubles as the
+     * checkpoint: paths already in it are skipped, so a killed worker picks up
+     * where it stopped. Unreadable results are not, so a read that failed on
+     * flaky storage is tried again. A torn last line is cut off before
+     * appending. With
+     * archive_dir set, lines are held back until the archive has synced
+     * their crops. Returns false if the file can't be opened, is locked by
+     * another process, or a write fails; after a failed write no new images
+     * are started.
+     */
+    bool run_shard(const std::vector<std::string> &manifest, const ShardOptions &opts, ShardProgress &progress);
+
+    /**
+     * Writes every shard's lines to out in manifest order, taking the last
+     * line for a path that was retried. missing counts the manifest entries
+     * no shard has a result for yet.
+     */
+    bool merge_shards(const std::vector<std::string> &manifest, const std::string &dir, int count,
+                      const std::string &out, size_t &missing);
+
+} // namespace ImageDetector
+
+#endif // IMAGE_DETECTOR_SHARD_H
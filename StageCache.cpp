@@ -0,0 +1,251 @@
+#include "StageCache.h"
+#include "Trace.h"
+
+#include <sstream>
+
+namespace ImageDetector
+{
+    StageCache::StageCache()
+    {
+        ready = 0;
+        inverted = false;
+        calls = 0;
+        for (int i = 0; i < STAGE_COUNT; i++)
+        {
+            runs[i] = 0;
+        }
+    }
+
+    void reset_cache(StageCache &cache, const cv::Mat &src)
+    {
+        cache.src = src;
+        cache.ready = 0;
+    } // reset_cache
+
+    static int first_stale_stage(const StageCache &cache, const DetectOptions &opts)
+    {
+        const DetectOptions &key = cache.key;
+        if (opts.scale != key.scale || opts.blur_size != key.blur_size)
+        {
+            return STAGE_SMOOTH;
+        }
+        if (opts.erode_size != key.erode_size)
+        {
+            return MIN(cache.ready, STAGE_MASK);
+        }
+        if (opts.epsilon != key.epsilon || opts.max_cosine != key.max_cosine || opts.min_area != key.min_area)
+        {
+            return MIN(cache.ready, STAGE_SQUARES);
+        }
+        return cache.ready;
+    } // first_stale_stage
+
+    static void run_stage(StageCache &cache, int stage, const DetectOptions &opts)
+    {
+        if (stage == STAGE_SMOOTH)
+        {
+            TraceSpan span("preprocess");
+            smooth(cache.src, cache.thresholded, opts);
+            cv::threshold(cache.thresholded, cache.thresholded, 0, 500, cv::THRESH_TRIANGLE);
+        }
+        else if (stage == STAGE_MASK)
+        {
+            TraceSpan span("find_contours");
+            erode_mask(cache.thresholded, cache.mask, opts.erode_size);
+
+            cv::Mat inverse;
+            cv::bitwise_not(cache.mask, inverse);
+            cv::findContours(inverse, cache.contours[0], cv::RETR_LIST, cv::CHAIN_APPROX_SIMPLE);
+            cv::findContours(cache.mask, cache.contours[1], cv::RETR_LIST, cv::CHAIN_APPROX_SIMPLE);
+        }
+        else
+        {
+            TraceSpan span("find_squares");
+            double min_area = opts.min_area * opts.scale * opts.scale;
+
+            std::vector<cv::Point> approx;
+            for (int p = 0; p < 2; p++)
+            {
+                cache.squares[p].clear();
+                for (size_t i = 0; i < cache.contours[p].size(); i++)
+                {
+                    if (is_square(cache.contours[p][i], approx, opts.epsilon, min_area, opts.max_cosine))
+                    {
+                        cache.squares[p].push_back(approx);
+                    }
+                }
+            }
+        }
+
+        cache.runs[stage]++;
+    } // run_stage
+
+    ImageDetails detect_cached(StageCache &cache, const DetectOptions &opts)
+    {
+        cache.calls++;
+
+        int stage = first_stale_stage(cache, opts);
+        for (int s = stage; s < STAGE_COUNT; s++)
+        {
+            run_stage(cache, s, opts);
+        }
+        cache.ready = STAGE_COUNT;
+        cache.key = opts;
+
+        // selection is cheap enough to redo every time, same order as
+        // detect_mask so ties go to the mask itself.
+        TraceSpan span("selection");
+        ImageDetails found[2];
+        std::vector<std::vector<cv::Point>> squares;
+        std::vector<cv::Point> l_sq;
+        for (int p = 0; p < 2; p++)
+        {
+            max_square_edges(cache.squares[p], squares);
+            largest_area(squares, l_sq);
+            restore_scale(l_sq, opts);
+            found[p] = details_from_square(l_sq);
+        }
+
+        cache.inverted = found[0].area() > found[1].area();
+        return cache.inverted ? found[0] : found[1];
+    } // detect_cached
+
+    template <typename T>
+    static bool parse_values(const std::string &list, std::vector<T> &dst)
+    {
+        dst.clear();
+
+        std::istringstream in(list);
+        std::string value;
+        while (std::getline(in, value, ','))
+        {
+            std::istringstream field(value);
+            T parsed;
+            if (!(field >> parsed) || !field.eof())
+            {
+                return false;
+            }
+            dst.push_back(parsed);
+        }
+
+        return !dst.empty();
+    } // parse_values
+
+    template <typename T>
+    static bool valid_values(const std::vector<T> &values, T DetectOptions::*field)
+    {
+        // each value on top of the defaults, which are valid themselves.
+        for (size_t i = 0; i < values.size(); i++)
+        {
+            DetectOptions opts = DetectOptions();
+            opts.*field = values[i];
+            if (!valid_pipeline(opts))
+            {
+                return false;
+            }
+        }
+        return true;
+    } // valid_values
+
+    bool parse_grid(const std::string &spec, SweepGrid &grid)
+    {
+        grid = SweepGrid();
+
+        std::istringstream in(spec);
+        std::string term;
+        while (in >> term)
+        {
+            size_t eq = term.find('=');
+            if (eq == std::string::npos)
+            {
+                return false;
+            }
+
+            std::string name = term.substr(0, eq);
+            std::string values = term.substr(eq + 1);
+
+            bool ok;
+            if (name == "scale")
+                ok = parse_values(values, grid.scales) && valid_values(grid.scales, &DetectOptions::scale);
+            else if (name == "blur")
+                ok = parse_values(values, grid.blur_sizes) && valid_values(grid.blur_sizes, &DetectOptions::blur_size);
+            else if (name == "erode")
+                ok = parse_values(values, grid.erode_sizes) && valid_values(grid.erode_sizes, &DetectOptions::erode_size);
+            else if (name == "epsilon")
+                ok = parse_values(values, grid.epsilons) && valid_values(grid.epsilons, &DetectOptions::epsilon);
+            else if (name == "cosine")
+                ok = parse_values(values, grid.max_cosines) && valid_values(grid.max_cosines, &DetectOptions::max_cosine);
+            else
+                ok = false;
+
+            if (!ok)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    } // parse_grid
+
+    template <typename T>
+    static std::vector<T> or_base(const std::vector<T> &values, T base)
+    {
+        return values.empty() ? std::vector<T>(1, base) : values;
+    } // or_base
+
+    void sweep(const std::vector<std::string> &paths, const SweepGrid &grid, const DetectOptions &base,
+               SweepCallback done)
+    {
+        std::vector<double> scales = or_base(grid.scales, base.scale);
+        std::vector<int> blur_sizes = or_base(grid.blur_sizes, base.blur_size);
+        std::vector<int> erode_sizes = or_base(grid.erode_sizes, base.erode_size);
+        std::vector<double> epsilons = or_base(grid.epsilons, base.epsilon);
+        std::vector<double> max_cosines = or_base(grid.max_cosines, base.max_cosine);
+
+        StageCache cache = StageCache();
+
+        for (size_t i = 0; i < paths.size(); i++)
+        {
+            SweepResult r = SweepResult();
+            r.path = paths[i];
+            r.opts = base;
+
+            cv::Mat img = cv::imread(paths[i], cv::IMREAD_COLOR);
+            r.ok = !img.empty();
+            if (!r.ok)
+            {
+                r.reused = 0;
+                done(r);
+                continue;
+            }
+
+            reset_cache(cache, img);
+
+            for (size_t s = 0; s < scales.size(); s++)
+            {
+                for (size_t b = 0; b < blur_sizes.size(); b++)
+                {
+                    for (size_t e = 0; e < erode_sizes.size(); e++)
+                    {
+                        for (size_t p = 0; p < epsilons.size(); p++)
+                        {
+                            for (size_t c = 0; c < max_cosines.size(); c++)
+                            {
+                                r.opts.scale = scales[s];
+                                r.opts.blur_size = blur_sizes[b];
+                                r.opts.erode_size = erode_sizes[e];
+                                r.opts.epsilon = epsilons[p];
+                                r.opts.max_cosine = max_cosines[c];
+
+                                r.reused = first_stale_stage(cache, r.opts);
+                                r.details = detect_cached(cache, r.opts);
+                                done(r);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    } // sweep
+
+} // namespace ImageDetector
@@ -0,0 +1,106 @@
+#ifndef IMAGE_DETECTOR_STAGE_CACHE_H
+#define IMAGE_DETECTOR_STAGE_CACHE_H
+
+#include "ImageDetector.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace ImageDetector
+{
+    // stages in pipeline order. Each one is cached under the parameters it
+    // reads, and changing a parameter re-runs its stage and everything after.
+    static const int STAGE_SMOOTH = 0;  // gray, scale, blur and threshold: scale, blur_size
+    static const int STAGE_MASK = 1;    // erode and findContours: erode_size
+    static const int STAGE_SQUARES = 2; // approxPolyDP and is_square: epsilon, max_cosine, min_area
+    static const int STAGE_COUNT = 3;
+
+    /**
+     * The intermediate results of detect_v2's mask path for one image, for
+     * re-running it with different parameters. Index 0 of contours and squares
+     * is the inverted mask, index 1 the mask itself.
+     */
+    class StageCache
+    {
+    public:
+        StageCache();
+
+        cv::Mat src;
+
+        // stages before ready are still valid for the parameters in key.
+        int ready;
+        DetectOptions key;
+
+        cv::Mat thresholded;
+        cv::Mat mask;
+        std::vector<std::vector<cv::Point>> contours[2];
+        std::vector<std::vector<cv::Point>> squares[2];
+
+        // set when the last result came from the inverted mask.
+        bool inverted;
+
+        // detect_cached calls and how often each stage actually ran.
+        size_t calls;
+        size_t runs[STAGE_COUNT];
+    };
+
+    /**
+     * Points the cache at a new image, dropping every cached stage.
+     */
+    void reset_cache(StageCache &cache, const cv::Mat &src);
+
+    /**
+     * Same result as detect_v2 with early_exit, run_length and edge_verify off
+     * and no roi or size/aspect limits, but only re-runs the stages whose
+     * parameters differ from the last call.
+     */
+    ImageDetails detect_cached(StageCache &cache, const DetectOptions &opts);
+
+    /**
+     * Values to try for each parameter. Empty lists keep the base setting.
+     */
+    class SweepGrid
+    {
+    public:
+        std::vector<double> scales;
+        std::vector<int> blur_sizes;
+        std::vector<int> erode_sizes;
+        std::vector<double> epsilons;
+        std::vector<double> max_cosines;
+    };
+
+    /**
+     * Parses a spec like "scale=1,0.5 blur=3,5 erode=0,3 epsilon=0.02,0.04
+     * cosine=0.2,0.3". Returns false on an unknown name, a value that doesn't
+     * parse, or one valid_pipeline rejects.
+     */
+    bool parse_grid(const std::string &spec, SweepGrid &grid);
+
+    class SweepResult
+    {
+    public:
+        std::string path;
+        DetectOptions opts;
+        ImageDetails details;
+
+        // false when the image could not be read.
+        bool ok;
+
+        // leading stages served from the cache, out of STAGE_COUNT.
+        int reused;
+    };
+
+    typedef std::function<void(const SweepResult &)> SweepCallback;
+
+    /**
+     * Runs every combination in grid, on top of base, over each image. Images
+     * are loaded once and the grid is walked with the earliest stage's
+     * parameters outermost, so most combinations only re-run the last stage.
+     */
+    void sweep(const std::vector<std::string> &paths, const SweepGrid &grid, const DetectOptions &base,
+               SweepCallback done);
+
+} // namespace ImageDetector
+
+#endif // IMAGE_DETECTOR_STAGE_CACHE_H
@@ -0,0 +1,202 @@
+#include "ThreadBudget.h"
+
+#include "opencv2/core.hpp"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+namespace ImageDetector
+{
+    // image size at which one more inner thread pays for its fork/join cost.
+    // A 1080p screenshot stays single threaded, an 8K one gets about eight.
+    static const double MEGAPIXELS_PER_INNER_THREAD = 4;
+
+    ThreadSplit::ThreadSplit()
+    {
+        workers = 1;
+        inner = 1;
+    }
+
+    static std::vector<int> allowed_cpus()
+    {
+        std::vector<int> cpus;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            {
+                if (CPU_ISSET(cpu, &set))
+                {
+                    cpus.push_back(cpu);
+                }
+            }
+        }
+
+        return cpus;
+    } // allowed_cpus
+
+    int available_cores()
+    {
+        int cores = (int)allowed_cpus().size();
+        return cores > 0 ? cores : MAX(1, cv::getNumberOfCPUs());
+    } // available_cores
+
+    ThreadSplit plan_threads(int cores, size_t images, double megapixels)
+    {
+        ThreadSplit split = ThreadSplit();
+        cores = MAX(1, cores);
+
+        // OpenCV has one pool for the whole process. Workers in parallel_for_
+        // at the same time don't get a pool each: one fans out over it and
+        // the rest run their loops alone. So the pool adds inner - 1 threads
+        // on top of the workers rather than multiplying them.
+        split.inner = MAX(1, MIN(cores, (int)(megapixels / MEGAPIXELS_PER_INNER_THREAD)));
+        split.workers = MAX(1, cores - split.inner + 1);
+
+        if (images > 0 && (size_t)split.workers > images)
+        {
+            split.workers = (int)images;
+            split.inner = MAX(1, cores - split.workers + 1);
+        }
+
+        return split;
+    } // plan_threads
+
+    static bool parse_cpulist(const std::string &list, std::vector<int> &cpus)
+    {
+        // e.g. "0-15,32-47"
+        std::istringstream in(list);
+        std::string range;
+        while (std::getline(in, range, ','))
+        {
+            int first = 0;
+            int last = 0;
+            char dash = 0;
+            std::istringstream field(range);
+            if (!(field >> first))
+            {
+                return false;
+            }
+            if (!(field >> dash >> last))
+            {
+                last = first;
+            }
+
+            for (int cpu = first; cpu <= last; cpu++)
+            {
+                cpus.push_back(cpu);
+            }
+        }
+
+        return true;
+    } // parse_cpulist
+
+    std::vector<std::vector<int>> numa_cpus()
+    {
+        std::vector<int> allowed = allowed_cpus();
+        std::vector<bool> usable;
+        for (size_t i = 0; i < allowed.size(); i++)
+        {
+            if ((size_t)allowed[i] >= usable.size())
+            {
+                usable.resize(allowed[i] + 1, false);
+            }
+            usable[allowed[i]] = true;
+        }
+
+        std::vector<std::vector<int>> nodes;
+        for (int node = 0;; node++)
+        {
+            std::ifstream in(("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist").c_str());
+            std::string list;
+            if (!in.is_open() || !std::getline(in, list))
+            {
+                break;
+            }
+
+            std::vector<int> listed;
+            std::vector<int> cpus;
+            if (!parse_cpulist(list, listed))
+            {
+                continue;
+            }
+            for (size_t i = 0; i < listed.size(); i++)
+            {
+                if ((size_t)listed[i] < usable.size() && usable[listed[i]])
+                {
+                    cpus.push_back(listed[i]);
+                }
+            }
+
+            // nodes we may not run on at all are left out.
+            if (!cpus.empty())
+            {
+                nodes.push_back(cpus);
+            }
+        }
+
+        if (nodes.empty() && !allowed.empty())
+        {
+            nodes.push_back(allowed);
+        }
+
+        return nodes;
+    } // numa_cpus
+
+    std::vector<int> worker_cpus(const std::vector<std::vector<int>> &nodes, int worker)
+    {
+        std::vector<int> cpus;
+        if (nodes.empty())
+        {
+            return cpus;
+        }
+
+        // more workers than a node has CPUs wrap around and share.
+        const std::vector<int> &node = nodes[worker % nodes.size()];
+        int slot = worker / (int)nodes.size();
+        cpus.push_back(node[slot % node.size()]);
+
+        return cpus;
+    } // worker_cpus
+
+    bool pin_thread(const std::vector<int> &cpus)
+    {
+        if (cpus.empty())
+        {
+            return false;
+        }
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (size_t i = 0; i < cpus.size(); i++)
+        {
+            CPU_SET(cpus[i], &set);
+        }
+
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    } // pin_thread
+
+    class WarmUp : public cv::ParallelLoopBody
+    {
+    public:
+        void operator()(const cv::Range &) const {}
+    };
+
+    int set_inner_threads(int inner)
+    {
+        int previous = cv::getNumThreads();
+        cv::setNumThreads(inner);
+
+        // the pool is created lazily by the first parallel_for_ that needs it.
+        cv::parallel_for_(cv::Range(0, MAX(inner, 1)), WarmUp());
+
+        return previous;
+    } // set_inner_threads
+
+} // namespace ImageDetector
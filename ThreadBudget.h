@@ -0,0 +1,66 @@
+#ifndef IMAGE_DETECTOR_THREAD_BUDGET_H
+#define IMAGE_DETECTOR_THREAD_BUDGET_H
+
+#include <stddef.h>
+
+#include <vector>
+
+namespace ImageDetector
+{
+    /**
+     * How a core budget is shared out: workers images in flight at once, and
+     * inner threads in OpenCV's process wide parallel_for_ pool, which the
+     * workers share.
+     */
+    class ThreadSplit
+    {
+    public:
+        ThreadSplit();
+
+        int workers;
+        int inner;
+    };
+
+    /**
+     * Cores this process may run on, from its affinity mask, so cpusets and
+     * taskset are respected.
+     */
+    int available_cores();
+
+    /**
+     * Picks a split of cores for images of about megapixels each. Small images
+     * gain little from OpenCV's own threading, so those get one image per core;
+     * large ones get a few inner threads, and the workers take the cores
+     * left beside the pool's inner - 1 extra threads. Short batches hand the
+     * cores they can't fill with images to the inner threads.
+     */
+    ThreadSplit plan_threads(int cores, size_t images, double megapixels);
+
+    /**
+     * The CPUs this process may use, grouped by NUMA node. Machines without
+     * NUMA information come back as one group.
+     */
+    std::vector<std::vector<int>> numa_cpus();
+
+    /**
+     * The CPU given to one worker. Workers go round robin over the nodes so
+     * memory traffic is spread out.
+     */
+    std::vector<int> worker_cpus(const std::vector<std::vector<int>> &nodes, int worker);
+
+    /**
+     * Restricts the calling thread to cpus. Returns false if the kernel
+     * refused.
+     */
+    bool pin_thread(const std::vector<int> &cpus);
+
+    /**
+     * Sets OpenCV's thread count for parallel_for_ and starts its pool from
+     * the calling thread. The pool threads take that thread's affinity, so
+     * call this before pinning any workers. Returns the previous count.
+     */
+    int set_inner_threads(int inner);
+
+} // namespace ImageDetector
+
+#endif // IMAGE_DETECTOR_THREAD_BUDGET_H
@@ -0,0 +1,226 @@
+#include "Trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+namespace ImageDetector
+{
+    class TraceEvent
+    {
+    public:
+        const char *name;
+        long long start;
+        long long duration;
+    };
+
+    /**
+     * One thread's ring. Only the owning thread writes; head is published with
+     * release so write_trace sees complete events.
+     */
+    class TraceBuffer
+    {
+    public:
+        TraceBuffer(size_t capacity, int tid) : events(capacity), head(0), tid(tid), exited(false) {}
+
+        std::vector<TraceEvent> events;
+        std::atomic<size_t> head;
+        int tid;
+        std::string name;
+
+        // set once the owning thread is gone, guarded by buffers_mutex.
+        bool exited;
+    };
+
+    static std::atomic<bool> tracing(false);
+    static std::atomic<size_t> buffer_events(65536);
+    static std::atomic<int> next_tid(1);
+
+    // buffers outlive their threads so spans from finished workers are still
+    // there to write out. write_trace frees them once written.
+    static std::mutex buffers_mutex;
+    static std::vector<TraceBuffer *> buffers;
+
+    static void free_buffer(TraceBuffer *buffer)
+    {
+        buffers.erase(std::find(buffers.begin(), buffers.end(), buffer));
+        delete buffer;
+    } // free_buffer
+
+    /**
+     * A thread's buffer, handed back when the thread exits. One that recorded
+     * nothing is freed right away.
+     */
+    class ThreadTrace
+    {
+    public:
+        ThreadTrace() : buffer(NULL) {}
+
+        ~ThreadTrace()
+        {
+            if (buffer == NULL)
+            {
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(buffers_mutex);
+            if (buffer->head.load(std::memory_order_relaxed) == 0)
+            {
+                free_buffer(buffer);
+            }
+            else
+            {
+                buffer->exited = true;
+            }
+        }
+
+        TraceBuffer *buffer;
+        std::string name;
+    };
+
+    static thread_local ThreadTrace thread_trace;
+
+    static long long now_us()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    } // now_us
+
+    static TraceBuffer *current_buffer()
+    {
+        // only called once tracing is on, so untraced runs never allocate.
+        if (thread_trace.buffer == NULL)
+        {
+            std::lock_guard<std::mutex> lock(buffers_mutex);
+            thread_trace.buffer = new TraceBuffer(buffer_events, next_tid++);
+            thread_trace.buffer->name = thread_trace.name;
+            buffers.push_back(thread_trace.buffer);
+        }
+
+        return thread_trace.buffer;
+    } // current_buffer
+
+    TraceSpan::TraceSpan(const char *name)
+    {
+        this->name = name;
+        start = tracing.load(std::memory_order_relaxed) ? now_us() : -1;
+    }
+
+    TraceSpan::~TraceSpan()
+    {
+        if (start < 0)
+        {
+            return;
+        }
+
+        TraceBuffer *buffer = current_buffer();
+        size_t head = buffer->head.load(std::memory_order_relaxed);
+
+        TraceEvent &event = buffer->events[head % buffer->events.size()];
+        event.name = name;
+        event.start = start;
+        event.duration = now_us() - start;
+
+        buffer->head.store(head + 1, std::memory_order_release);
+    }
+
+    void start_tracing(size_t events_per_thread)
+    {
+        buffer_events = events_per_thread > 0 ? events_per_thread : 1;
+        tracing = true;
+    } // start_tracing
+
+    void stop_tracing()
+    {
+        tracing = false;
+    } // stop_tracing
+
+    void trace_thread_name(const std::string &name)
+    {
+        thread_trace.name = name;
+        if (thread_trace.buffer != NULL)
+        {
+            thread_trace.buffer->name = name;
+        }
+    } // trace_thread_name
+
+    static void write_string(std::ofstream &out, const std::string &s)
+    {
+        out << '"';
+        for (size_t i = 0; i < s.size(); i++)
+        {
+            if (s[i] == '"' || s[i] == '\\')
+            {
+                out << '\\';
+            }
+            out << s[i];
+        }
+        out << '"';
+    } // write_string
+
+    bool write_trace(const std::string &path)
+    {
+        std::ofstream out(path.c_str());
+        if (!out.is_open())
+        {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+
+        out << "{\"traceEvents\":[" << std::endl;
+        bool first = true;
+
+        for (size_t b = 0; b < buffers.size(); b++)
+        {
+            TraceBuffer *buffer = buffers[b];
+
+            if (!buffer->name.empty())
+            {
+                out << (first ? "" : ",\n")
+                    << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid
+                    << ",\"args\":{\"name\":";
+                write_string(out, buffer->name);
+                out << "}}";
+                first = false;
+            }
+
+            // once the ring has wrapped only the newest capacity events remain.
+            size_t head = buffer->head.load(std::memory_order_acquire);
+            size_t capacity = buffer->events.size();
+            size_t begin = head > capacity ? head - capacity : 0;
+
+            for (size_t i = begin; i < head; i++)
+            {
+                const TraceEvent &event = buffer->events[i % capacity];
+                out << (first ? "" : ",\n")
+                    << "{\"name\":";
+                write_string(out, event.name);
+                out << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid
+                    << ",\"ts\":" << event.start
+                    << ",\"dur\":" << event.duration
+                    << "}";
+                first = false;
+            }
+        }
+
+        out << std::endl
+            << "]}" << std::endl;
+
+        // finished threads' spans are written out now, so their buffers can go.
+        for (size_t b = buffers.size(); b > 0; b--)
+        {
+            if (buffers[b - 1]->exited)
+            {
+                free_buffer(buffers[b - 1]);
+            }
+        }
+
+        return out.good();
+    } // write_trace
+
+} // namespace ImageDetector
@@ -0,0 +1,52 @@
+#ifndef IMAGE_DETECTOR_TRACE_H
+#define IMAGE_DETECTOR_TRACE_H
+
+#include <stddef.h>
+
+#include <string>
+
+namespace ImageDetector
+{
+    /**
+     * Times a scope as one span on the calling thread's timeline. When tracing
+     * is off this costs one relaxed atomic load.
+     */
+    class TraceSpan
+    {
+    public:
+        TraceSpan(const char *name);
+        ~TraceSpan();
+
+    private:
+        const char *name;
+        long long start;
+    };
+
+    /**
+     * Turns span recording on. Each thread records into its own ring buffer of
+     * events_per_thread spans, allocated at its first span, and keeps only the
+     * newest once it wraps.
+     */
+    void start_tracing(size_t events_per_thread = 65536);
+
+    /**
+     * Turns span recording off. Recorded spans are kept for write_trace.
+     */
+    void stop_tracing();
+
+    /**
+     * Labels the calling thread's row in the trace viewer. Only the name is
+     * kept while tracing is off.
+     */
+    void trace_thread_name(const std::string &name);
+
+    /**
+     * Writes every recorded span as Chrome Trace Event JSON, which
+     * chrome://tracing and ui.perfetto.dev both open. Call once the threads
+     * being traced have finished; their buffers are freed once written.
+     */
+    bool write_trace(const std::string &path);
+
+} // namespace ImageDetector
+
+#endif // IMAGE_DETECTOR_TRACE_H
@@ -0,0 +1,289 @@
+#include "Tuning.h"
+
+#include <fstream>
+#include <map>
+#include <sstream>
+
+namespace ImageDetector
+{
+    // rectangles overlapping at least this much (intersection over union)
+    // count as the same answer.
+    static const double AGREEMENT_IOU = 0.9;
+
+    // each candidate is timed this many times and the fastest run is kept.
+    static const int TIMING_RUNS = 2;
+
+    TuningEntry::TuningEntry()
+    {
+        scale = 1.0;
+        blur_size = 5;
+        erode_size = 3;
+        epsilon = 0.02;
+        ms = 0;
+        agreement = 1.0;
+        samples = 0;
+    }
+
+    static bool same_setting(const TuningEntry &a, const TuningEntry &b)
+    {
+        return a.scale == b.scale && a.blur_size == b.blur_size && a.erode_size == b.erode_size &&
+               a.epsilon == b.epsilon;
+    } // same_setting
+
+    static int find_setting(const std::vector<TuningEntry> &entries, const TuningEntry &setting)
+    {
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            if (same_setting(entries[i], setting))
+            {
+                return (int)i;
+            }
+        }
+        return -1;
+    } // find_setting
+
+    static std::vector<TuningEntry> candidate_settings()
+    {
+        static const double scales[] = {1.0, 0.5, 0.25};
+        static const int blur_sizes[] = {3, 5};
+        static const int erode_sizes[] = {0, 3};
+        static const double epsilons[] = {0.02, 0.04};
+
+        std::vector<TuningEntry> candidates;
+        for (size_t s = 0; s < 3; s++)
+        {
+            for (size_t b = 0; b < 2; b++)
+            {
+                for (size_t e = 0; e < 2; e++)
+                {
+                    for (size_t p = 0; p < 2; p++)
+                    {
+                        TuningEntry entry = TuningEntry();
+                        entry.scale = scales[s];
+                        entry.blur_size = blur_sizes[b];
+                        entry.erode_size = erode_sizes[e];
+                        entry.epsilon = epsilons[p];
+                        candidates.push_back(entry);
+                    }
+                }
+            }
+        }
+
+        // the defaults always agree with themselves, so every class has
+        // at least one setting that meets any accuracy target. The grid
+        // normally holds them already, and timing them twice is wasted.
+        if (find_setting(candidates, TuningEntry()) < 0)
+        {
+            candidates.push_back(TuningEntry());
+        }
+
+        return candidates;
+    } // candidate_settings
+
+    static void entry_options(const TuningEntry &entry, DetectOptions &opts)
+    {
+        opts.scale = entry.scale;
+        opts.blur_size = entry.blur_size;
+        opts.erode_size = entry.erode_size;
+        opts.epsilon = entry.epsilon;
+    } // entry_options
+
+    static bool agrees(ImageDetails a, ImageDetails b)
+    {
+        if (a.area() <= 0 || b.area() <= 0)
+        {
+            return a.area() <= 0 && b.area() <= 0;
+        }
+
+        cv::Rect ra = cv::Rect(a.x, a.y, a.w, a.h);
+        cv::Rect rb = cv::Rect(b.x, b.y, b.w, b.h);
+        double overlap = (ra & rb).area();
+        return overlap / (ra.area() + rb.area() - overlap) >= AGREEMENT_IOU;
+    } // agrees
+
+    std::string resolution_class(cv::Size size)
+    {
+        double mp = size.width * (double)size.height / 1e6;
+        double ratio = size.height / (double)MAX(size.width, 1);
+
+        std::string name;
+        if (mp < 1)
+            name = "sd";
+        else if (mp < 4)
+            name = "hd";
+        else if (mp < 12)
+            name = "4k";
+        else
+            name = "8k";
+
+        if (ratio < 0.8)
+            name += "-wide";
+        else if (ratio < 1.25)
+            name += "-square";
+        else if (ratio < 2.0)
+            name += "-tall";
+        else
+            name += "-xtall";
+
+        return name;
+    } // resolution_class
+
+    bool load_profile(const std::string &path, TuningProfile &profile)
+    {
+        profile.entries.clear();
+
+        std::ifstream in(path.c_str());
+        if (!in.is_open())
+        {
+            return false;
+        }
+
+        std::string line;
+        while (std::getline(in, line))
+        {
+            if (line.empty() || line[0] == '#')
+            {
+                continue;
+            }
+
+            std::istringstream fields(line);
+            TuningEntry entry = TuningEntry();
+            fields >> entry.name >> entry.scale >> entry.blur_size >> entry.erode_size >> entry.epsilon >> entry.ms >> entry.agreement >> entry.samples;
+
+            DetectOptions opts = DetectOptions();
+            entry_options(entry, opts);
+
+            if (!entry.name.empty() && !fields.fail() && valid_pipeline(opts))
+            {
+                profile.entries.push_back(entry);
+            }
+        }
+
+        return true;
+    } // load_profile
+
+    bool save_profile(const std::string &path, const TuningProfile &profile)
+    {
+        std::ofstream out(path.c_str());
+        if (!out.is_open())
+        {
+            return false;
+        }
+
+        out << "# class scale blur_size erode_size epsilon ms agreement samples" << std::endl;
+        for (size_t i = 0; i < profile.entries.size(); i++)
+        {
+            const TuningEntry &entry = profile.entries[i];
+            out << entry.name
+                << " " << entry.scale
+                << " " << entry.blur_size
+                << " " << entry.erode_size
+                << " " << entry.epsilon
+                << " " << entry.ms
+                << " " << entry.agreement
+                << " " << entry.samples
+                << std::endl;
+        }
+
+        return out.good();
+    } // save_profile
+
+    void apply_profile(const TuningProfile &profile, cv::Size size, DetectOptions &opts)
+    {
+        std::string name = resolution_class(size);
+        for (size_t i = 0; i < profile.entries.size(); i++)
+        {
+            if (profile.entries[i].name == name)
+            {
+                entry_options(profile.entries[i], opts);
+                return;
+            }
+        }
+    } // apply_profile
+
+    void calibrate(const std::vector<std::string> &paths, double accuracy, TuningProfile &profile)
+    {
+        profile.entries.clear();
+
+        std::vector<TuningEntry> candidates = candidate_settings();
+
+        // per class, one running total per candidate.
+        std::map<std::string, std::vector<TuningEntry>> totals;
+
+        for (size_t i = 0; i < paths.size(); i++)
+        {
+            cv::Mat img = cv::imread(paths[i], cv::IMREAD_COLOR);
+            if (img.empty())
+            {
+                continue;
+            }
+
+            std::string name = resolution_class(img.size());
+            std::vector<TuningEntry> &sums = totals[name];
+            if (sums.empty())
+            {
+                sums = candidates;
+                for (size_t c = 0; c < sums.size(); c++)
+                {
+                    sums[c].name = name;
+                    sums[c].agreement = 0;
+                }
+            }
+
+            DetectStats stats = DetectStats();
+            ImageDetails reference = detect_v2(img, DetectOptions(), stats);
+
+            for (size_t c = 0; c < candidates.size(); c++)
+            {
+                DetectOptions opts = DetectOptions();
+                entry_options(candidates[c], opts);
+
+                double best_ms = 0;
+                ImageDetails found = ImageDetails();
+                for (int run = 0; run < TIMING_RUNS; run++)
+                {
+                    int64 start = cv::getTickCount();
+                    found = detect_v2(img, opts, stats);
+                    double ms = (cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency();
+                    best_ms = run == 0 ? ms : MIN(best_ms, ms);
+                }
+
+                sums[c].ms += best_ms;
+                sums[c].agreement += agrees(reference, found) ? 1 : 0;
+                sums[c].samples++;
+            }
+        }
+
+        std::map<std::string, std::vector<TuningEntry>>::iterator it;
+        for (it = totals.begin(); it != totals.end(); ++it)
+        {
+            std::vector<TuningEntry> &sums = it->second;
+
+            int best = -1;
+            for (size_t c = 0; c < sums.size(); c++)
+            {
+                sums[c].ms /= sums[c].samples;
+                sums[c].agreement /= sums[c].samples;
+
+                if (sums[c].agreement < accuracy)
+                {
+                    continue;
+                }
+
+                if (best < 0 || sums[c].ms < sums[best].ms)
+                {
+                    best = (int)c;
+                }
+            }
+
+            // an accuracy target above 1 can't be met, fall back to the defaults.
+            if (best < 0)
+            {
+                best = find_setting(sums, TuningEntry());
+            }
+
+            profile.entries.push_back(sums[best]);
+        }
+    } // calibrate
+
+} // namespace ImageDetector
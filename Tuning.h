@@ -0,0 +1,71 @@
+#ifndef IMAGE_DETECTOR_TUNING_H
+#define IMAGE_DETECTOR_TUNING_H
+
+#include "ImageDetector.h"
+
+#include <string>
+#include <vector>
+
+namespace ImageDetector
+{
+    /**
+     * The settings picked for one resolution/aspect class, along with what
+     * they measured at calibration time.
+     */
+    class TuningEntry
+    {
+    public:
+        TuningEntry();
+
+        std::string name;
+        double scale;
+        int blur_size;
+        int erode_size;
+        double epsilon;
+
+        // mean detect_v2 time and the share of samples matching full resolution.
+        double ms;
+        double agreement;
+        int samples;
+    };
+
+    class TuningProfile
+    {
+    public:
+        std::vector<TuningEntry> entries;
+    };
+
+    /**
+     * Names the resolution/aspect class for an image of the given size, e.g.
+     * "hd-tall" for a 1080x2340 phone screenshot.
+     */
+    std::string resolution_class(cv::Size size);
+
+    /**
+     * Reads a profile written by save_profile, skipping lines that don't
+     * parse or hold settings valid_pipeline rejects. Returns false if the
+     * file could not be opened.
+     */
+    bool load_profile(const std::string &path, TuningProfile &profile);
+
+    /**
+     * Writes the profile as one whitespace separated line per class.
+     */
+    bool save_profile(const std::string &path, const TuningProfile &profile);
+
+    /**
+     * Copies the profile's settings for size's class into opts. Classes the
+     * profile has no entry for keep whatever opts already holds.
+     */
+    void apply_profile(const TuningProfile &profile, cv::Size size, DetectOptions &opts);
+
+    /**
+     * Runs every candidate setting over the sample images and keeps, per class,
+     * the fastest one whose rectangles agree with the full resolution result on
+     * at least accuracy of the samples.
+     */
+    void calibrate(const std::vector<std::string> &paths, double accuracy, TuningProfile &profile);
+
+} // namespace ImageDetector
+
+#endif // IMAGE_DETECTOR_TUNING_H
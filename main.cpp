@@ -1,276 +1,823 @@
-#include "opencv2/opencv.hpp"
 #include "opencv2/core.hpp"
 #include "opencv2/imgproc.hpp"
 #include "opencv2/imgcodecs.hpp"
-#include "opencv2/highgui.hpp"
 
+// headless builds link only core, imgproc and imgcodecs, see make headless.
+#ifndef IMAGE_DETECTOR_HEADLESS
+#include "opencv2/highgui.hpp"
+#endif
+
+#include "Archive.h"
+#include "Batch.h"
+#include "ImageDetector.h"
+#include "LayoutHint.h"
+#include "Shard.h"
+#include "StageCache.h"
+#include "Trace.h"
+#include "Tuning.h"
+
+#include <fstream>
 #include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
-double angle(cv::Point pt1, cv::Point pt2, cv::Point pt0)
+void crop_image(cv::Mat src, std::vector<cv::Point> sq, cv::Mat &dst)
 {
-    double dx1 = pt1.x - pt0.x;
-    double dy1 = pt1.y - pt0.y;
-    double dx2 = pt2.x - pt0.x;
-    double dy2 = pt2.y - pt0.y;
-    return (dx1 * dx2 + dy1 * dy2) / sqrt((dx1 * dx1 + dy1 * dy1) * (dx2 * dx2 + dy2 * dy2) + 1e-10);
+    int h = abs(sq[0].y - sq[1].y);
+    int w = abs(sq[1].x - sq[2].x);
+
+    std::cout
+        << "x: " << sq[0].x
+        << "\ty: " << sq[0].y
+        << "\th: " << h
+        << "\tw: " << w
+        << std::endl
+        << std::endl;
+
+    cv::Rect rect = cv::Rect(sq[0].x, sq[0].y, w, h);
+
+    // cv::Mat ref = src(cv::Range(sq[0].x, sq[0].y), cv::Range(h, w));
+    cv::Mat ref = src(rect);
+    ref.copyTo(dst);
 }
 
-void find_squares(cv::Mat &src, std::vector<std::vector<cv::Point>> &squares)
+#ifndef IMAGE_DETECTOR_HEADLESS
+void find_image(cv::Mat src, const ImageDetector::DetectOptions &opts)
 {
-    squares.clear();
+    ImageDetector::DetectStats stats = ImageDetector::DetectStats();
 
-    std::vector<std::vector<cv::Point>> contours;
-    cv::findContours(src, contours, cv::RETR_LIST, cv::CHAIN_APPROX_SIMPLE);
+    std::vector<cv::Point> l_sq = ImageDetector::detect(src, opts, stats);
 
-    std::vector<cv::Point> approx;
+    std::cout
+        << "allocations: " << stats.allocations
+        << "\tpool hits: " << stats.pool_hits
+        << "\tminor faults: " << stats.minor_faults
+        << "\tmajor faults: " << stats.major_faults
+        << "\tearly exit: " << stats.early_exit
+        << std::endl
+        << std::endl;
 
-    for (size_t i = 0; i < contours.size(); i++)
+    if (l_sq.size() != 4)
     {
-        cv::approxPolyDP(contours[i], approx, cv::arcLength(contours[i], true) * 0.02, true);
+        std::cout << "Could not find an image" << std::endl;
+        return;
+    }
 
-        if (approx.size() == 4 &&
-            fabs(cv::contourArea(approx)) > 1000 &&
-            cv::isContourConvex(approx))
-        {
-            double maxCosine = 0;
+    // filter again for display only, detect keeps its mask internal.
+    cv::Mat dst;
+    ImageDetector::preprocess(src, dst);
 
-            for (int j = 2; j < 5; j++)
-            {
-                double cosine = fabs(angle(approx[j % 4], approx[j - 2], approx[j - 1]));
-                maxCosine = MAX(maxCosine, cosine);
-            }
+    std::vector<std::vector<cv::Point>> l_sqs;
+    l_sqs.push_back(l_sq);
 
-            if (maxCosine < 0.3)
-            {
-                squares.push_back(approx);
-            }
-        }
+    // cvtColor to bgr so that polylines are green and not gray
+    cv::cvtColor(dst, dst, cv::COLOR_GRAY2BGR);
+    cv::polylines(dst, l_sqs, true, cv::Scalar(0, 255, 0), 3, cv::LINE_AA);
+
+    cv::Mat cropped;
+    {
+        ImageDetector::TraceSpan span("crop");
+        crop_image(src, l_sq, cropped);
+    }
+
+    cv::imshow("original", src);
+    cv::imshow(__func__, dst);
+    cv::imshow("cropped", cropped);
+}
+#endif // IMAGE_DETECTOR_HEADLESS
+
+void usage()
+{
+    std::cout
+        << "usage: image-detector [--json] [--trace <file>] [--profile <file>] [--early-exit] [--run-length] [--edge-verify] [--race] [--hints <file>] <image>" << std::endl
+        << "       image-detector --batch [--json] [--trace <file>] [--workers <n>] [--inner-threads <n>] [--pin] [--memory-budget <mb>] [--profile <file>] [--early-exit] [--run-length] [--edge-verify] [--race] [--hints <file>] [--archive <dir>] <image>..." << std::endl
+        << "       image-detector --calibrate <profile> <accuracy> <image>..." << std::endl
+        << "       image-detector --learn-hints <hints> <image or results.ndjson>..." << std::endl
+        << "       image-detector --manifest <file> --shard <i>/<n> --out <dir> [batch options]" << std::endl
+        << "       image-detector --archive-list <dir>" << std::endl
+        << "       image-detector --repair-archive <dir>" << std::endl
+        << "       image-detector --merge <manifest> <dir> <n> <out>" << std::endl
+        << "       image-detector --thread-bench [--pin] <image>..." << std::endl
+        << "       image-detector --sweep \"scale=1,0.5 blur=3,5 erode=0,3 epsilon=0.02,0.04 cosine=0.2,0.3\" <image>..." << std::endl
+#ifndef IMAGE_DETECTOR_HEADLESS
+        << "       image-detector --tune <image>" << std::endl
+#endif
+        ;
+}
+
+void print_result(const ImageDetector::BatchResult &r)
+{
+    if (!r.ok)
+    {
+        std::cout << "Could not read image: " << r.path << std::endl;
+        return;
+    }
+
+    std::cout
+        << r.path
+        << "\tx: " << r.details.x
+        << "\ty: " << r.details.y
+        << "\th: " << r.details.h
+        << "\tw: " << r.details.w
+        << "\treduction: " << r.reduction;
+
+    if (!r.strategy.empty())
+    {
+        std::cout << "\tstrategy: " << r.strategy;
+    }
+
+    if (!r.crop.empty())
+    {
+        std::cout << "\tcrop: " << r.crop;
     }
+
+    std::cout
+        << "\tms: " << r.ms
+        << std::endl;
 }
 
 /**
- * Contour sometimes returns uneven rectangle due to rounded corners. This function
- * accounts for that and expands the rectangle to the max bounds of the src
- * vectors setting it to out.
+ * One JSON object per line so results can be streamed into other tools.
  */
-void max_square_edges(std::vector<std::vector<cv::Point>> src, std::vector<std::vector<cv::Point>> &dst)
+void print_json(const ImageDetector::BatchResult &r)
 {
-    dst.clear();
+    std::cout << ImageDetector::result_json(r) << std::endl;
+}
 
-    // first get the max min x and y values for each set of points
-    for (size_t i = 0; i < src.size(); i++)
+int write_trace(const std::string &trace_path)
+{
+    if (trace_path.empty())
     {
-        int max_x = INT_MIN;
-        int min_x = INT_MAX;
-        int max_y = INT_MIN;
-        int min_y = INT_MAX;
+        return 0;
+    }
 
-        for (size_t j = 0; j < src[i].size(); j++)
-        {
-            if (max_x == INT_MIN)
-                max_x = src[i][j].x;
-            if (min_x == INT_MAX)
-                max_x = src[i][j].x;
-            if (max_y == INT_MIN)
-                max_y = src[i][j].y;
-            if (min_y == INT_MAX)
-                min_y = src[i][j].y;
-
-            max_x = MAX(max_x, src[i][j].x);
-            min_x = MIN(min_x, src[i][j].x);
-
-            max_y = MAX(max_y, src[i][j].y);
-            min_y = MIN(min_y, src[i][j].y);
-
-            std::cout
-                << "x: " << src[i][j].x
-                << "\ty: " << src[i][j].y
-                << "\tmin x: " << min_x
-                << "\tmax x: " << max_x
-                << "\tmin y: " << min_y
-                << "\tmax y: " << max_y
-                << std::endl;
-        }
+    // losing race strategies must not record spans while the trace is
+    // written. run_batch joins its helpers already; this covers any other
+    // caller.
+    ImageDetector::stop_race_helpers();
+    ImageDetector::stop_tracing();
+    if (!ImageDetector::write_trace(trace_path))
+    {
+        std::cout << "Could not write trace: " << trace_path << std::endl;
+        return 1;
+    }
 
-        std::cout << std::endl;
+    return 0;
+}
 
-        std::cout
-            << "max x: " << max_x
-            << "\tmax y: " << max_y
-            << "\tmax y: " << max_y
-            << "\tmin y: " << min_y
-            << std::endl
-            << std::endl;
+int close_archive(ImageDetector::ArchiveWriter &archive, const std::string &archive_dir, size_t crops_failed)
+{
+    if (archive_dir.empty())
+    {
+        return 0;
+    }
 
-        std::vector<cv::Point> square_p;
+    if (!archive.close())
+    {
+        std::cout << "Could not write archive: " << archive_dir << std::endl;
+        return 1;
+    }
+
+    if (crops_failed > 0)
+    {
+        std::cout << "Could not archive " << crops_failed << " crops: " << archive_dir << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
 
-        // index 0 - top left, min x, min y
-        cv::Point top_left;
-        top_left.x = min_x;
-        top_left.y = min_y;
-        square_p.push_back(top_left);
+int calibrate(int argc, char *argv[])
+{
+    if (argc < 5)
+    {
+        usage();
+        return 1;
+    }
 
-        // index 1 - bottom left, min x, max y
-        cv::Point bottom_left;
-        bottom_left.x = min_x;
-        bottom_left.y = max_y;
-        square_p.push_back(bottom_left);
+    std::string profile_path = argv[2];
+    double accuracy = atof(argv[3]);
+    std::vector<std::string> paths(argv + 4, argv + argc);
 
-        // index 2 - bottom right, max x, max y
-        cv::Point bottom_right;
-        bottom_right.x = max_x;
-        bottom_right.y = max_y;
-        square_p.push_back(bottom_right);
+    ImageDetector::TuningProfile profile;
+    ImageDetector::calibrate(paths, accuracy, profile);
 
-        // index 3 - top right, max x, min y
-        cv::Point top_right;
-        top_right.x = max_x;
-        top_right.y = min_y;
-        square_p.push_back(top_right);
+    for (size_t i = 0; i < profile.entries.size(); i++)
+    {
+        const ImageDetector::TuningEntry &entry = profile.entries[i];
+        std::cout
+            << entry.name
+            << "\tscale: " << entry.scale
+            << "\tblur: " << entry.blur_size
+            << "\terode: " << entry.erode_size
+            << "\tepsilon: " << entry.epsilon
+            << "\tms: " << entry.ms
+            << "\tagreement: " << entry.agreement
+            << "\tsamples: " << entry.samples
+            << std::endl;
+    }
 
-        dst.push_back(square_p);
+    if (!ImageDetector::save_profile(profile_path, profile))
+    {
+        std::cout << "Could not write profile: " << profile_path << std::endl;
+        return 1;
     }
+
+    return 0;
 }
 
-int avg_color_row(cv::Mat row)
+int merge(int argc, char *argv[])
 {
-    // get values as 0-255
-    std::vector<int> shape = row.reshape(0);
+    int count = 0;
+    char extra = 0;
+    if (argc != 6 || sscanf(argv[4], "%d%c", &count, &extra) != 1 || count < 1)
+    {
+        usage();
+        return 1;
+    }
 
-    // get average and determine if closer to 0 or 255
-    size_t len = shape.size();
-    int total = 0;
-    for (size_t i = 0; i < shape.size(); i++)
+    std::vector<std::string> manifest;
+    if (!ImageDetector::load_manifest(argv[2], manifest))
     {
-        total += shape[i];
+        std::cout << "Could not read manifest: " << argv[2] << std::endl;
+        return 1;
     }
 
-    return total / len;
+    size_t missing = 0;
+    if (!ImageDetector::merge_shards(manifest, argv[3], count, argv[5], missing))
+    {
+        std::cout << "Could not write: " << argv[5] << std::endl;
+        return 1;
+    }
+
+    std::cout
+        << "merged: " << manifest.size() - missing
+        << "\tmissing: " << missing
+        << std::endl;
+
+    return missing > 0 ? 2 : 0;
 }
 
-/**
- * Determines if the first row of an image is white.
- */
-bool first_row_is_white(cv::Mat src)
+int shard(const std::string &manifest_path, const ImageDetector::ShardOptions &opts)
 {
-    int avg = avg_color_row(src.row(0));
-    int d_white = abs(255 - avg);
-    int d_black = abs(0 - avg);
-    bool is_white = d_white < d_black;
+    std::vector<std::string> manifest;
+    if (!ImageDetector::load_manifest(manifest_path, manifest))
+    {
+        std::cout << "Could not read manifest: " << manifest_path << std::endl;
+        return 1;
+    }
+
+    ImageDetector::ShardProgress progress;
+    bool ok = ImageDetector::run_shard(manifest, opts, progress);
 
     std::cout
-        << "avg: " << avg
-        << "\tis_white: " << is_white
-        << "\td_white: " << d_white
-        << "\td_black: " << d_black
-        << std::endl
+        << "shard: " << opts.index << "/" << opts.count
+        << "\tassigned: " << progress.assigned
+        << "\tresumed: " << progress.resumed
+        << "\tprocessed: " << progress.processed
+        << "\tretried: " << progress.retried
+        << "\tcrops failed: " << progress.crops_failed
         << std::endl;
 
-    return is_white;
+    if (!ok)
+    {
+        std::cout << "Could not write shard: " << ImageDetector::shard_file(opts.dir, opts.index, opts.count) << std::endl;
+        return 1;
+    }
+
+    return progress.crops_failed > 0 ? 1 : 0;
+}
+
+int archive_list(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        usage();
+        return 1;
+    }
+
+    ImageDetector::ArchiveReader reader;
+    reader.open(argv[2]);
+
+    for (size_t i = 0; i < reader.size(); i++)
+    {
+        ImageDetector::ArchiveRecord record = reader.at(i);
+        std::cout
+            << std::string(record.path, record.path_size)
+            << "\tx: " << record.details.x
+            << "\ty: " << record.details.y
+            << "\th: " << record.details.h
+            << "\tw: " << record.details.w
+            << "\tbytes: " << record.data_size
+            << std::endl;
+    }
+
+    return 0;
+}
+
+int repair_archive(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        usage();
+        return 1;
+    }
+
+    int repaired = ImageDetector::repair_archive(argv[2]);
+    if (repaired < 0)
+    {
+        std::cout << "Could not repair archive: " << argv[2] << std::endl;
+        return 1;
+    }
+
+    std::cout << "repaired: " << repaired << std::endl;
+    return 0;
 }
 
 /**
- * Finds the largest square by area
+ * Learns a hint per source directory from where the images were found, read
+ * from stored --json results or by detecting images without hints.
  */
-void largest_area(std::vector<std::vector<cv::Point>> squares, std::vector<cv::Point> &dst)
+int learn_hints(int argc, char *argv[])
 {
-    dst.clear();
+    if (argc < 4)
+    {
+        usage();
+        return 1;
+    }
 
-    int l_area;
-    std::vector<cv::Point> l_square;
+    std::string hints_path = argv[2];
 
-    // loop over squares
-    for (size_t i = 0; i < squares.size(); i++)
-    {
-        // 3rd point is the bottom right so we can calculate the area off that
-        int h = squares[i][0].y - squares[i][1].y;
-        int w = squares[i][1].x - squares[i][2].x;
-        int area = h * w;
+    std::vector<ImageDetector::HintSample> samples;
+    auto add_sample = [&samples](const ImageDetector::BatchResult &r) {
+        if (!r.ok)
+        {
+            return;
+        }
 
-        if (i == 0)
+        ImageDetector::HintSample sample;
+        sample.source = ImageDetector::hint_source(r.path);
+        sample.frame = r.frame;
+        sample.details = r.details;
+        samples.push_back(sample);
+    };
+
+    // stored --json results are learned from as they are; anything else is
+    // an image to detect first.
+    std::vector<std::string> paths;
+    for (int i = 3; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg.size() < 7 || arg.compare(arg.size() - 7, 7, ".ndjson") != 0)
         {
-            l_square = squares[i];
-            l_area = area;
+            paths.push_back(arg);
             continue;
         }
 
-        if (area > l_area)
+        std::ifstream in(arg.c_str());
+        if (!in)
         {
-            l_area = area;
-            l_square = squares[i];
+            std::cout << "Could not read results: " << arg << std::endl;
+            return 1;
         }
+
+        std::string line;
+        ImageDetector::BatchResult r;
+        while (std::getline(in, line))
+        {
+            if (ImageDetector::parse_result_json(line, r))
+            {
+                add_sample(r);
+            }
+        }
+    }
+
+    if (!paths.empty())
+    {
+        ImageDetector::run_batch(paths, ImageDetector::BatchOptions(), add_sample);
+    }
+
+    ImageDetector::HintProfile profile;
+    ImageDetector::learn_hints(samples, profile);
+
+    for (size_t i = 0; i < profile.hints.size(); i++)
+    {
+        const ImageDetector::LayoutHint &hint = profile.hints[i];
+        std::cout
+            << hint.source
+            << "\troi: " << hint.roi_x << "," << hint.roi_y << " " << hint.roi_w << "x" << hint.roi_h
+            << "\taspect: " << hint.min_aspect << "-" << hint.max_aspect
+            << "\tfraction: " << hint.min_fraction << "-" << hint.max_fraction
+            << "\tsamples: " << hint.samples
+            << std::endl;
+    }
+
+    if (!ImageDetector::save_hints(hints_path, profile))
+    {
+        std::cout << "Could not write hints: " << hints_path << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Times run_batch over the images at every power of two split of the cores,
+ * marking the one plan_batch_threads would pick.
+ */
+int thread_bench(int argc, char *argv[])
+{
+    ImageDetector::BatchOptions batch = ImageDetector::BatchOptions();
+
+    int arg = 2;
+    if (arg < argc && std::string(argv[arg]) == "--pin")
+    {
+        batch.pin = true;
+        arg++;
+    }
+
+    if (arg >= argc)
+    {
+        usage();
+        return 1;
+    }
+
+    std::vector<std::string> paths(argv + arg, argv + argc);
+    ImageDetector::ThreadSplit picked = ImageDetector::plan_batch_threads(paths, batch);
+    int cores = ImageDetector::available_cores();
+
+    // one untimed pass so every split reads from the page cache.
+    ImageDetector::run_batch(paths, batch, [](const ImageDetector::BatchResult &) {});
+
+    for (int inner = 1; inner <= cores; inner *= 2)
+    {
+        batch.workers = MAX(1, cores - inner + 1);
+        batch.inner_threads = inner;
+        ImageDetector::ThreadSplit split = ImageDetector::plan_batch_threads(paths, batch);
+
+        int64 start = cv::getTickCount();
+        ImageDetector::run_batch(paths, batch, [](const ImageDetector::BatchResult &) {});
+        double ms = (cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency();
+
+        std::cout
+            << "workers: " << split.workers
+            << "\tinner: " << split.inner
+            << "\tms: " << ms
+            << "\timages/s: " << paths.size() * 1000.0 / ms
+            << (split.workers == picked.workers && split.inner == picked.inner ? "\tpicked" : "")
+            << std::endl;
     }
 
-    dst = l_square;
+    return 0;
 }
 
-void crop_image(cv::Mat src, std::vector<cv::Point> sq, cv::Mat &dst)
+void print_sweep(const ImageDetector::SweepResult &r)
 {
-    int h = abs(sq[0].y - sq[1].y);
-    int w = abs(sq[1].x - sq[2].x);
+    if (!r.ok)
+    {
+        std::cout << "Could not read image: " << r.path << std::endl;
+        return;
+    }
 
     std::cout
-        << "x: " << sq[0].x
-        << "\ty: " << sq[0].y
-        << "\th: " << h
-        << "\tw: " << w
-        << std::endl
+        << r.path
+        << "\tscale: " << r.opts.scale
+        << "\tblur: " << r.opts.blur_size
+        << "\terode: " << r.opts.erode_size
+        << "\tepsilon: " << r.opts.epsilon
+        << "\tcosine: " << r.opts.max_cosine
+        << "\tx: " << r.details.x
+        << "\ty: " << r.details.y
+        << "\th: " << r.details.h
+        << "\tw: " << r.details.w
+        << "\tcached stages: " << r.reused
         << std::endl;
+}
 
-    cv::Rect rect = cv::Rect(sq[0].x, sq[0].y, w, h);
+int sweep(int argc, char *argv[])
+{
+    ImageDetector::SweepGrid grid;
+    if (argc < 4 || !ImageDetector::parse_grid(argv[2], grid))
+    {
+        usage();
+        return 1;
+    }
 
-    // cv::Mat ref = src(cv::Range(sq[0].x, sq[0].y), cv::Range(h, w));
-    cv::Mat ref = src(rect);
-    ref.copyTo(dst);
+    std::vector<std::string> paths(argv + 3, argv + argc);
+    ImageDetector::sweep(paths, grid, ImageDetector::DetectOptions(), print_sweep);
+    return 0;
 }
 
-void find_image(cv::Mat src)
+#ifndef IMAGE_DETECTOR_HEADLESS
+/**
+ * Trackbar positions for --tune. Each move only re-runs the stages after the
+ * parameter that changed.
+ */
+class TuneState
 {
-    cv::Mat dst;
+public:
+    ImageDetector::StageCache cache;
+
+    int scale_percent;
+    int blur_size;
+    int erode_size;
+    int epsilon_thousandths;
+    int cosine_hundredths;
+};
+
+void on_tune(int, void *data)
+{
+    TuneState &state = *(TuneState *)data;
 
-    src.copyTo(dst);
+    ImageDetector::DetectOptions opts = ImageDetector::DetectOptions();
+    opts.scale = MAX(state.scale_percent, 1) / 100.0;
+    opts.blur_size = state.blur_size > 1 ? state.blur_size | 1 : 0;
+    opts.erode_size = state.erode_size;
+    opts.epsilon = MAX(state.epsilon_thousandths, 1) / 1000.0;
+    opts.max_cosine = state.cosine_hundredths / 100.0;
 
-    cv::cvtColor(dst, dst, cv::COLOR_BGR2GRAY);
-    cv::medianBlur(dst, dst, 5);
-    cv::threshold(dst, dst, 0, 500, cv::THRESH_TRIANGLE);
-    cv::morphologyEx(dst, dst, cv::MORPH_ERODE, cv::Mat());
+    int64 start = cv::getTickCount();
+    ImageDetector::ImageDetails found = ImageDetector::detect_cached(state.cache, opts);
+    double ms = (cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency();
 
-    // at this point, determine if the image is a dark or light mode UI.
-    // background color must be black for this to work
-    if (first_row_is_white(dst))
+    std::cout
+        << "x: " << found.x
+        << "\ty: " << found.y
+        << "\th: " << found.h
+        << "\tw: " << found.w
+        << "\tms: " << ms
+        << std::endl;
+
+    cv::Mat shown = state.cache.src.clone();
+    cv::rectangle(shown, cv::Rect(found.x, found.y, found.w, found.h), cv::Scalar(0, 255, 0), 3, cv::LINE_AA);
+    cv::imshow("tune", shown);
+    // show the polarity the square was found on.
+    cv::Mat mask;
+    if (state.cache.inverted)
+    {
+        cv::bitwise_not(state.cache.mask, mask);
+    }
+    else
     {
-        cv::bitwise_not(dst, dst);
+        mask = state.cache.mask;
     }
+    cv::imshow("mask", mask);
+}
 
-    std::vector<std::vector<cv::Point>> maybe_squares;
-    find_squares(dst, maybe_squares);
+int tune(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        usage();
+        return 1;
+    }
 
-    // find_squares sometimes returns rhombuses so we need to
-    // "expand" the four corners to be the max x and y values of it.
-    std::vector<std::vector<cv::Point>> squares;
-    max_square_edges(maybe_squares, squares);
+    cv::Mat img = cv::imread(argv[2], cv::IMREAD_COLOR);
+    if (img.empty())
+    {
+        std::cout << "Could not read image: " << argv[2] << std::endl;
+        return 1;
+    }
 
-    // get largest square.
-    std::vector<std::vector<cv::Point>> l_sqs;
-    std::vector<cv::Point> l_sq;
-    largest_area(squares, l_sq);
-    l_sqs.push_back(l_sq);
+    ImageDetector::DetectOptions defaults = ImageDetector::DetectOptions();
 
-    // cvtColor to bgr so that polylines are green and not gray
-    cv::cvtColor(dst, dst, cv::COLOR_GRAY2BGR);
-    cv::polylines(dst, l_sqs, true, cv::Scalar(0, 255, 0), 3, cv::LINE_AA);
+    TuneState state;
+    ImageDetector::reset_cache(state.cache, img);
+    state.scale_percent = (int)(defaults.scale * 100);
+    state.blur_size = defaults.blur_size;
+    state.erode_size = defaults.erode_size;
+    state.epsilon_thousandths = (int)(defaults.epsilon * 1000);
+    state.cosine_hundredths = (int)(defaults.max_cosine * 100);
 
-    cv::Mat cropped;
-    crop_image(src, l_sq, cropped);
+    cv::namedWindow("tune");
+    cv::createTrackbar("scale %", "tune", &state.scale_percent, 100, on_tune, &state);
+    cv::createTrackbar("blur", "tune", &state.blur_size, 31, on_tune, &state);
+    cv::createTrackbar("erode", "tune", &state.erode_size, 15, on_tune, &state);
+    cv::createTrackbar("epsilon x1000", "tune", &state.epsilon_thousandths, 100, on_tune, &state);
+    cv::createTrackbar("cosine x100", "tune", &state.cosine_hundredths, 100, on_tune, &state);
+    on_tune(0, &state);
 
-    cv::imshow("original", src);
-    cv::imshow(__func__, dst);
-    cv::imshow("cropped", cropped);
+    char key;
+    do
+    {
+        key = (char)cv::waitKey(0);
+    } while (key != 'q');
+
+    return 0;
 }
+#endif // IMAGE_DETECTOR_HEADLESS
 
 int main(int argc, char *argv[])
 {
-    cv::String img_path = argv[1];
+    if (argc > 1 && std::string(argv[1]) == "--calibrate")
+    {
+        return calibrate(argc, argv);
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--sweep")
+    {
+        return sweep(argc, argv);
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--thread-bench")
+    {
+        return thread_bench(argc, argv);
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--learn-hints")
+    {
+        return learn_hints(argc, argv);
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--merge")
+    {
+        return merge(argc, argv);
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--archive-list")
+    {
+        return archive_list(argc, argv);
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--repair-archive")
+    {
+        return repair_archive(argc, argv);
+    }
+
+#ifndef IMAGE_DETECTOR_HEADLESS
+    if (argc > 1 && std::string(argv[1]) == "--tune")
+    {
+        return tune(argc, argv);
+    }
+#endif
+
+    ImageDetector::BatchOptions batch = ImageDetector::BatchOptions();
+    bool batch_mode = false;
+    bool json = false;
+    std::string trace_path;
+    std::string manifest_path;
+    std::string archive_dir;
+    ImageDetector::ShardOptions sharding = ImageDetector::ShardOptions();
+
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++)
+    {
+        std::string flag = argv[arg];
+        if (flag == "--profile" && arg + 1 < argc)
+        {
+            std::string profile_path = argv[++arg];
+            if (!ImageDetector::load_profile(profile_path, batch.profile))
+            {
+                std::cout << "Could not read profile: " << profile_path << std::endl;
+                return 1;
+            }
+        }
+        else if (flag == "--hints" && arg + 1 < argc)
+        {
+            std::string hints_path = argv[++arg];
+            if (!ImageDetector::load_hints(hints_path, batch.hints))
+            {
+                std::cout << "Could not read hints: " << hints_path << std::endl;
+                return 1;
+            }
+        }
+        else if (flag == "--early-exit")
+        {
+            batch.detect.early_exit = true;
+        }
+        else if (flag == "--run-length")
+        {
+            batch.detect.run_length = true;
+        }
+        else if (flag == "--edge-verify")
+        {
+            batch.detect.edge_verify = true;
+        }
+        else if (flag == "--race")
+        {
+            batch.race = true;
+        }
+        else if (flag == "--trace" && arg + 1 < argc)
+        {
+            trace_path = argv[++arg];
+            ImageDetector::start_tracing();
+            ImageDetector::trace_thread_name("main");
+        }
+        else if (flag == "--batch")
+        {
+            batch_mode = true;
+        }
+        else if (flag == "--json")
+        {
+            json = true;
+        }
+        else if (flag == "--workers" && arg + 1 < argc)
+        {
+            batch.workers = atoi(argv[++arg]);
+        }
+        else if (flag == "--inner-threads" && arg + 1 < argc)
+        {
+            batch.inner_threads = atoi(argv[++arg]);
+        }
+        else if (flag == "--pin")
+        {
+            batch.pin = true;
+        }
+        else if (flag == "--manifest" && arg + 1 < argc)
+        {
+            manifest_path = argv[++arg];
+        }
+        else if (flag == "--shard" && arg + 1 < argc)
+        {
+            if (sscanf(argv[++arg], "%d/%d", &sharding.index, &sharding.count) != 2 ||
+                sharding.count < 1 || sharding.index < 0 || sharding.index >= sharding.count)
+            {
+                usage();
+                return 1;
+            }
+        }
+        else if (flag == "--out" && arg + 1 < argc)
+        {
+            sharding.dir = argv[++arg];
+        }
+        else if (flag == "--archive" && arg + 1 < argc)
+        {
+            archive_dir = argv[++arg];
+        }
+        else if (flag == "--memory-budget" && arg + 1 < argc)
+        {
+            batch.memory_budget = (size_t)(atof(argv[++arg]) * 1024 * 1024);
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    if (!manifest_path.empty())
+    {
+        // the shard opens its archive only once it holds the shard's lock.
+        sharding.batch = batch;
+        sharding.archive_dir = archive_dir;
+        int status = shard(manifest_path, sharding);
+        return write_trace(trace_path) != 0 ? 1 : status;
+    }
+
+    if (arg >= argc)
+    {
+        usage();
+        return 1;
+    }
+
+    // every process writes its own segments, named for its host and pid so
+    // processes on different nodes can share the directory.
+    ImageDetector::ArchiveWriter archive;
+    if (!archive_dir.empty())
+    {
+        char host[256] = "";
+        gethostname(host, sizeof(host) - 1);
+        std::string name = "crops-" + std::string(host) + "-" + std::to_string(getpid());
+        if (!archive.open(archive_dir, name))
+        {
+            std::cout << "Could not open archive: " << archive_dir << std::endl;
+            return 1;
+        }
+        batch.archive = &archive;
+    }
+
+#ifdef IMAGE_DETECTOR_HEADLESS
+    // without highgui a single image is just a batch of one.
+    batch_mode = true;
+#endif
+
+    // racing, run length masks, hints and archiving are only wired into the
+    // batch path, a single image is a batch of one.
+    if (batch_mode || json || batch.race || batch.detect.run_length || !batch.hints.hints.empty() ||
+        batch.archive != NULL)
+    {
+        std::vector<std::string> paths(argv + arg, argv + (batch_mode ? argc : arg + 1));
+        size_t crops_failed = 0;
+        ImageDetector::run_batch(paths, batch, [&](const ImageDetector::BatchResult &r) {
+            crops_failed += r.crop == "failed" ? 1 : 0;
+            if (json)
+            {
+                print_json(r);
+            }
+            else
+            {
+                print_result(r);
+            }
+        });
+        int status = close_archive(archive, archive_dir, crops_failed);
+        return write_trace(trace_path) != 0 ? 1 : status;
+    }
+
+#ifndef IMAGE_DETECTOR_HEADLESS
+
+    cv::String img_path = argv[arg];
 
     cv::Mat img = cv::imread(img_path, cv::IMREAD_COLOR);
     if (img.empty())
@@ -279,13 +826,21 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    find_image(img);
+    ImageDetector::DetectOptions opts = batch.detect;
+    ImageDetector::apply_profile(batch.profile, img.size(), opts);
+    find_image(img, opts);
+
+    if (write_trace(trace_path) != 0)
+    {
+        return 1;
+    }
 
     char key;
     do
     {
         key = (char)cv::waitKey(0);
     } while (key != 'q');
+#endif // IMAGE_DETECTOR_HEADLESS
 
     return 0;
 }